@@ -0,0 +1,359 @@
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    yavm_aot [-m] <image>[,<image>...] <output.c> : translates an LC-3 image ahead of time into a C
+    translation unit, see aot.h for what the generated code provides. With -m the unit also gets a main()
+    that runs the image like vm_c does.
+
+    Code is discovered from 0x3000 by following branches, fall-throughs, JSR targets and the return points
+    after JSR, JSRR and traps. JMP and JSRR targets are only known at run time and go through the
+    dispatcher, so code only reachable that way (jump tables, pointers kept in data) is interpreted. So is
+    anything in the device page and RTI or the reserved opcode.
+*/
+
+#define SEGMENT_GAP 16 // zero words that split the embedded image into separate segments
+
+static uint8_t leader[0x10000];
+static uint16_t worklist[0x10000];
+static uint32_t worklistSize;
+
+static void addLeader(uint16_t address) {
+    if (address >= MR_KBSR || leader[address]) {
+        return;
+    }
+    leader[address] = 1;
+    worklist[worklistSize++] = address;
+}
+
+// 1 if the block has to end after the instruction at `address`, queues the addresses control may go to next
+static int endsBlock(struct lc3_vm *vm, uint16_t address) {
+    struct lc3_decoded d = decode(memoryPeek(vm, address));
+    uint16_t next = address + 1;
+    switch (d.handler) {
+        case D_BR:
+            if (!d.dr) {
+                return 0;
+            }
+            addLeader(next + d.imm);
+            if (d.dr != 0x7) {
+                addLeader(next);
+            }
+            return 1;
+        case D_JSR:
+            addLeader(next + d.imm);
+            addLeader(next);
+            return 1;
+        case D_JSRR:
+            addLeader(next);
+            return 1;
+        case D_TRAP:
+            if (d.imm != TRAP_HALT) {
+                addLeader(next);
+            }
+            return 1;
+        case D_JMP:
+        case D_NOP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// last address of the block starting at `start`
+static uint16_t blockEnd(struct lc3_vm *vm, uint16_t start) {
+    uint16_t address = start;
+    while (!endsBlock(vm, address) && address + 1 < MR_KBSR && !leader[address + 1]) {
+        ++address;
+    }
+    return address;
+}
+
+static void findBlocks(struct lc3_vm *vm) {
+    addLeader(0x3000);
+    while (worklistSize) {
+        blockEnd(vm, worklist[--worklistSize]);
+    }
+}
+
+// control continues at `target` without a PC update when it has a block
+static void emitGoto(FILE *out, uint16_t target) {
+    if (target < MR_KBSR && leader[target]) {
+        fprintf(out, "    goto B_%04X;\n", target);
+    } else {
+        fprintf(out, "    r[R_PC] = 0x%04X;\n    goto interpret;\n", target);
+    }
+}
+
+/*
+    A store that hits translated code kills the block there and leaves this one, uncounting the
+    instructions of this block that did not run.
+*/
+static void emitStore(FILE *out, const char *address, int sr, uint16_t next, uint32_t remaining) {
+    fprintf(out, "    {\n        uint16_t t = %s;\n        aotWrite(vm, t, r[%d]);\n", address, sr);
+    fprintf(out, "        if (codeMap[t]) {\n");
+    fprintf(out, "            aotInvalidate(blocks, BLOCK_COUNT, blockLive, codeMap, t);\n");
+    fprintf(out, "            r[R_PC] = 0x%04X;\n", next);
+    if (remaining) {
+        fprintf(out, "            count -= %u;\n", remaining);
+    }
+    fprintf(out, "            goto dispatch;\n        }\n    }\n");
+}
+
+// how a BR with this nzp mask compares the result in R_COND with 0, see conditionFlags()
+static const char *const resultTest[8] = {
+        [FL_NEG] = "<", [FL_ZR] = "==", [FL_POS] = ">",
+        [FL_NEG | FL_ZR] = "<=", [FL_NEG | FL_POS] = "!=", [FL_ZR | FL_POS] = ">=",
+};
+
+static void emitInstruction(FILE *out, struct lc3_vm *vm, uint16_t address, uint16_t end) {
+    struct lc3_decoded d = decode(memoryPeek(vm, address));
+    uint16_t next = address + 1;
+    uint32_t remaining = (uint32_t) (end - address);
+    char operand[64];
+    switch (d.handler) {
+        case D_ADD:
+            fprintf(out, "    r[%d] = r[%d] + r[%d];\n", d.dr, d.sr1, d.sr2);
+            break;
+        case D_ADD_IMM:
+            fprintf(out, "    r[%d] = r[%d] + 0x%04X;\n", d.dr, d.sr1, d.imm);
+            break;
+        case D_AND:
+            fprintf(out, "    r[%d] = r[%d] & r[%d];\n", d.dr, d.sr1, d.sr2);
+            break;
+        case D_AND_IMM:
+            fprintf(out, "    r[%d] = r[%d] & 0x%04X;\n", d.dr, d.sr1, d.imm);
+            break;
+        case D_NOT:
+            fprintf(out, "    r[%d] = ~r[%d];\n", d.dr, d.sr1);
+            break;
+        case D_LD:
+            fprintf(out, "    r[%d] = aotRead(vm, 0x%04X);\n", d.dr, (uint16_t) (next + d.imm));
+            break;
+        case D_LDI:
+            fprintf(out, "    r[%d] = aotRead(vm, aotRead(vm, 0x%04X));\n", d.dr, (uint16_t) (next + d.imm));
+            break;
+        case D_LDR:
+            fprintf(out, "    r[%d] = aotRead(vm, (uint16_t) (r[%d] + 0x%04X));\n", d.dr, d.sr1, d.imm);
+            break;
+        case D_LEA:
+            fprintf(out, "    r[%d] = 0x%04X;\n", d.dr, (uint16_t) (next + d.imm));
+            break;
+        case D_ST:
+            snprintf(operand, sizeof(operand), "0x%04X", (uint16_t) (next + d.imm));
+            break;
+        case D_STI:
+            snprintf(operand, sizeof(operand), "aotRead(vm, 0x%04X)", (uint16_t) (next + d.imm));
+            break;
+        case D_STR:
+            snprintf(operand, sizeof(operand), "(uint16_t) (r[%d] + 0x%04X)", d.sr1, d.imm);
+            break;
+        case D_BR:
+            if (d.dr == 0x7) {
+                emitGoto(out, next + d.imm);
+            } else if (d.dr) {
+                fprintf(out, "    if ((int16_t) r[R_COND] %s 0) {\n    ", resultTest[d.dr]);
+                emitGoto(out, next + d.imm);
+                fprintf(out, "    }\n");
+            }
+            return;
+        case D_JMP:
+            fprintf(out, "    r[R_PC] = r[%d];\n    goto dispatch;\n", d.sr1);
+            return;
+        case D_JSR:
+            fprintf(out, "    r[R_R7] = 0x%04X;\n", next);
+            emitGoto(out, next + d.imm);
+            return;
+        case D_JSRR:
+            fprintf(out, "    r[R_PC] = r[%d];\n    r[R_R7] = 0x%04X;\n    goto dispatch;\n", d.sr1, next);
+            return;
+        case D_TRAP:
+            fprintf(out, "    r[R_PC] = 0x%04X;\n    aotTrap(vm, 0x%02X);\n", next, d.imm);
+            fprintf(out, "    if (!vm->running) {\n        goto out;\n    }\n");
+            return;
+        case D_NOP:
+            // not counted here, interpret counts it
+            fprintf(out, "    --count;\n    r[R_PC] = 0x%04X;\n    goto interpret;\n", address);
+            return;
+    }
+    switch (d.handler) {
+        case D_ST:
+        case D_STI:
+        case D_STR:
+            emitStore(out, operand, d.dr, next, remaining);
+            break;
+        default:
+            fprintf(out, "    r[R_COND] = r[%d];\n", d.dr);
+    }
+}
+
+// finds the next run of image words at or after `*address`, runs are split at SEGMENT_GAP zero words in a row
+static int nextSegment(struct lc3_vm *vm, uint32_t *address, uint32_t *start, uint32_t *last) {
+    while (*address < 0x10000 && !memoryPeek(vm, *address)) {
+        ++*address;
+    }
+    if (*address == 0x10000) {
+        return 0;
+    }
+    *start = *last = *address;
+    while (*address < 0x10000 && *address - *last <= SEGMENT_GAP) {
+        if (memoryPeek(vm, *address)) {
+            *last = *address;
+        }
+        ++*address;
+    }
+    *address = *last + 1;
+    return 1;
+}
+
+// the image is embedded as it ended up in memory, so every format readImageFiles() accepts works
+static void emitImage(FILE *out, struct lc3_vm *vm) {
+    uint32_t segmentCount = 0;
+    uint32_t address = 0, start, last;
+    while (nextSegment(vm, &address, &start, &last)) {
+        fprintf(out, "static const uint16_t segment%u[] = {", segmentCount++);
+        for (uint32_t a = start; a <= last; ++a) {
+            fprintf(out, "%s0x%04X,", (a - start) % 12 ? " " : "\n        ", memoryPeek(vm, a));
+        }
+        fprintf(out, "\n};\n\n");
+    }
+
+    fprintf(out, "static const struct aot_segment segments[] = {\n");
+    segmentCount = 0;
+    address = 0;
+    while (nextSegment(vm, &address, &start, &last)) {
+        fprintf(out, "        {0x%04X, %u, segment%u},\n", start, last - start + 1, segmentCount++);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "void aotLoadImage(struct lc3_vm *vm) {\n");
+    fprintf(out, "    struct lc3_image *image = stageImage(vm);\n");
+    fprintf(out, "    for (size_t i = 0; i < sizeof(segments) / sizeof(segments[0]); ++i) {\n");
+    fprintf(out, "        memcpy(image->words + segments[i].origin, segments[i].words, segments[i].count * sizeof(uint16_t));\n");
+    fprintf(out, "        invalidateDecoded(vm, segments[i].origin, segments[i].count);\n");
+    fprintf(out, "    }\n    commitImage(vm, image);\n}\n\n");
+}
+
+static void emitRun(FILE *out, struct lc3_vm *vm) {
+    uint32_t blockCount = 0;
+    fprintf(out, "static const struct aot_block blocks[] = {\n");
+    for (uint32_t a = 0; a < MR_KBSR; ++a) {
+        if (leader[a]) {
+            fprintf(out, "        {0x%04X, 0x%04X},\n", a, blockEnd(vm, a));
+            ++blockCount;
+        }
+    }
+    fprintf(out, "};\n\n#define BLOCK_COUNT %u\n\n", blockCount);
+
+    // which code is still translated belongs to the guest, every call starts from a fresh copy
+    fprintf(out, "uint64_t aotRun(struct lc3_vm *vm) {\n");
+    fprintf(out, "    uint16_t *const r = vm->registers;\n");
+    fprintf(out, "    uint64_t count = 0;\n");
+    fprintf(out, "    uint8_t *const codeMap = calloc(0x10000 + BLOCK_COUNT, 1);\n");
+    fprintf(out, "    if (!codeMap) {\n        printf(\"Failed to allocate the block map\\n\");\n");
+    fprintf(out, "        exit(-1);\n    }\n");
+    fprintf(out, "    uint8_t *const blockLive = codeMap + 0x10000;\n");
+    fprintf(out, "    for (uint32_t i = 0; i < BLOCK_COUNT; ++i) {\n");
+    fprintf(out, "        blockLive[i] = 1;\n");
+    fprintf(out, "        memset(codeMap + blocks[i].start, 1, blocks[i].end - blocks[i].start + 1);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    startVm(vm);\n\n");
+
+    fprintf(out, "dispatch:\n    switch (r[R_PC]) {\n");
+    for (uint32_t a = 0; a < MR_KBSR; ++a) {
+        if (leader[a]) {
+            fprintf(out, "        case 0x%04X: goto B_%04X;\n", a, a);
+        }
+    }
+    fprintf(out, "        default: goto interpret;\n    }\n\n");
+
+    fprintf(out, "interpret:\n    ++count;\n    {\n        int32_t stored = aotStep(vm);\n");
+    fprintf(out, "        if (!vm->running) {\n            goto out;\n        }\n");
+    fprintf(out, "        if (stored >= 0 && codeMap[stored]) {\n");
+    fprintf(out, "            aotInvalidate(blocks, BLOCK_COUNT, blockLive, codeMap, (uint16_t) stored);\n");
+    fprintf(out, "        }\n    }\n    goto dispatch;\n");
+
+    uint32_t index = 0;
+    for (uint32_t a = 0; a < MR_KBSR; ++a) {
+        if (!leader[a]) {
+            continue;
+        }
+        uint16_t end = blockEnd(vm, a);
+        fprintf(out, "\nB_%04X:\n", a);
+        fprintf(out, "    if (!blockLive[%u]) {\n        r[R_PC] = 0x%04X;\n        goto interpret;\n    }\n", index++, a);
+        fprintf(out, "    count += %u;\n", end - a + 1);
+        for (uint32_t i = a; i <= end; ++i) {
+            emitInstruction(out, vm, (uint16_t) i, end);
+        }
+        // blocks that end in a conditional branch, a trap or at the next leader fall through
+        struct lc3_decoded d = decode(memoryPeek(vm, end));
+        int falls = !(d.handler == D_BR && d.dr == 0x7) && d.handler != D_JMP && d.handler != D_JSR &&
+                    d.handler != D_JSRR && d.handler != D_NOP && !(d.handler == D_TRAP && d.imm == TRAP_HALT);
+        if (falls) {
+            emitGoto(out, end + 1);
+        } else if (d.handler == D_TRAP) {
+            fprintf(out, "    goto out;\n");
+        }
+    }
+
+    fprintf(out, "\nout:\n    free(codeMap);\n    vm->instructionCount = count;\n    return count;\n}\n");
+}
+
+static void emitMain(FILE *out) {
+    fprintf(out, "\n// -s prints statistics, -u writes output unbuffered\n");
+    fprintf(out, "int main(int argc, char *argv[]) {\n");
+    fprintf(out, "    struct lc3_vm *vm = createVm();\n");
+    fprintf(out, "    setup(vm);\n");
+    fprintf(out, "    aotLoadImage(vm);\n");
+    fprintf(out, "    keyboardStartThread(&vm->keyboard);\n");
+    fprintf(out, "    int stats = 0;\n");
+    fprintf(out, "    for (int i = 1; i < argc; ++i) {\n");
+    fprintf(out, "        stats |= strcmp(argv[i], \"-s\") == 0;\n");
+    fprintf(out, "        if (strcmp(argv[i], \"-u\") == 0) {\n");
+    fprintf(out, "            vm->outputMode = OUTPUT_UNBUFFERED;\n");
+    fprintf(out, "        }\n    }\n\n");
+    fprintf(out, "    uint64_t start = monotonicNs();\n");
+    fprintf(out, "    uint64_t executed = aotRun(vm);\n");
+    fprintf(out, "    double elapsed = (double) (monotonicNs() - start) / 1e9;\n\n");
+    fprintf(out, "    restoreInputBuffering(vm);\n");
+    fprintf(out, "    if (stats) {\n");
+    fprintf(out, "        fprintf(stderr, \"%%\" PRIu64 \" instructions in %%.3f s (%%.1f M instructions/s)\\n\",\n");
+    fprintf(out, "                executed, elapsed, elapsed > 0 ? (double) executed / elapsed / 1e6 : 0.0);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    destroyVm(vm);\n");
+    fprintf(out, "    return 0;\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    int withMain = argc > 1 && strcmp(argv[1], "-m") == 0;
+    if (argc - withMain != 3) {
+        printf("Usage: ./yavm_aot [-m] <image>[,<image>...] <output.c>\n");
+        exit(1);
+    }
+    const char *images = argv[1 + withMain];
+    const char *path = argv[2 + withMain];
+
+    struct lc3_vm *vm = createVm();
+    readImageFiles(vm, images);
+    findBlocks(vm);
+
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        printf("Failed to create %s\n", path);
+        exit(-1);
+    }
+    fprintf(out, "// generated by yavm_aot from %s, do not edit\n\n", images);
+    fprintf(out, "#include \"aot.h\"\n#include <string.h>\n\n");
+    emitImage(out, vm);
+    emitRun(out, vm);
+    if (withMain) {
+        emitMain(out);
+    }
+    if (ferror(out) || fclose(out) != 0) {
+        printf("Failed to write %s\n", path);
+        exit(-1);
+    }
+    destroyVm(vm);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    Runtime support for C translation units generated by yavm_aot.
+
+    A generated unit defines aotLoadImage(), which copies the embedded image into guest memory, and aotRun(),
+    which starts the guest and runs it until HALT. Every reachable basic block of the image is a label in
+    aotRun(). Indirect jumps go through a switch over the block start addresses, and addresses without a
+    translated block are interpreted one instruction at a time until control reaches one again. A store
+    into translated code kills the block covering that word, which is interpreted from then on. Every call
+    keeps track of its dead blocks on its own, so guests running the same translation do not affect each other.
+
+    Translated code is built for plain interactive runs: it keeps the instruction count in a local, does
+    not check instruction or time limits and ignores the profiler, input logs and parkOnInput.
+*/
+
+void aotLoadImage(struct lc3_vm *vm);
+
+// returns the number of retired instructions
+uint64_t aotRun(struct lc3_vm *vm);
+
+struct aot_segment {
+    uint16_t origin;
+    uint16_t count;
+    const uint16_t *words;
+};
+
+// a translated basic block covers [start, end]
+struct aot_block {
+    uint16_t start;
+    uint16_t end;
+};
+
+// plain RAM is read directly, pages with a device go through memoryRead()
+static inline uint16_t aotRead(struct lc3_vm *vm, uint16_t address) {
+    return deviceMapped(vm, address) ? memoryRead(vm, address) : memoryPeek(vm, address);
+}
+
+static inline void aotWrite(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    if (!deviceMapped(vm, address)) {
+        memoryPoke(vm, address, value);
+        forgetDecoded(vm, address);
+    } else {
+        memoryWrite(vm, address, value);
+    }
+}
+
+static inline void aotTrap(struct lc3_vm *vm, uint16_t vector) {
+    struct lc3_decoded d = {D_TRAP, 0, 0, 0, vector};
+    trap(vm, &d);
+}
+
+// marks the block holding `address` dead, its words no longer count as translated code
+static inline void aotInvalidate(const struct aot_block *blocks, uint32_t blockCount, uint8_t *live,
+                                 uint8_t *codeMap, uint16_t address) {
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        if (blocks[i].start <= address && address <= blocks[i].end) {
+            live[i] = 0;
+            for (uint32_t a = blocks[i].start; a <= blocks[i].end; ++a) {
+                codeMap[a] = 0;
+            }
+            return;
+        }
+    }
+}
+
+static void (*const aotHandlers[D_COUNT])(struct lc3_vm *vm, const struct lc3_decoded *d) = {
+        [D_ADD] = add, [D_ADD_IMM] = addImm, [D_AND] = and, [D_AND_IMM] = andImm, [D_BR] = br,
+        [D_JMP] = jmp, [D_JSR] = jsr, [D_JSRR] = jsrr, [D_LD] = ld, [D_LDI] = ldi, [D_LDR] = ldr,
+        [D_LEA] = lea, [D_NOT] = not, [D_TRAP] = trap,
+};
+
+/*
+    Interprets the instruction at PC, the fallback for code without a live block. Stores are done here
+    so the caller learns their address and can kill a block they hit. Returns that address or -1.
+*/
+static inline int32_t aotStep(struct lc3_vm *vm) {
+    uint16_t pc = vm->registers[R_PC]++;
+    struct lc3_decoded d = decode(aotRead(vm, pc));
+    uint16_t address;
+    switch (d.handler) {
+        case D_ST:
+            address = vm->registers[R_PC] + d.imm;
+            break;
+        case D_STI:
+            address = memoryRead(vm, vm->registers[R_PC] + d.imm);
+            break;
+        case D_STR:
+            address = vm->registers[d.sr1] + d.imm;
+            break;
+        case D_NOP:
+            return -1;
+        default:
+            aotHandlers[d.handler](vm, &d);
+            return -1;
+    }
+    aotWrite(vm, address, vm->registers[d.dr]);
+    return address;
+}
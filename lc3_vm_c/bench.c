@@ -0,0 +1,356 @@
+#include "vm.h"
+#include "lockstep.h"
+#include <string.h>
+
+#ifdef YAVM_JIT
+#include "jit.h"
+#endif
+
+/*
+    vm_bench [-o <report.json>] [-d <objs dir>] [-n <instructions>]
+
+    Micro-benchmarks call every opcode handler, memoryRead()/memoryWrite() and both ways of decoding in a
+    tight loop. End-to-end runs play objs/2048.obj and objs/rogue.obj for a fixed number of instructions from
+    a scripted key sequence (no TTY, output to /dev/null), through the interpreter and, when built in, the
+    JIT, and LOCKSTEP_LANES of them with different sequences in lockstep. Every number is the best of
+    BENCH_REPEATS runs.
+*/
+
+#define BENCH_REPEATS 3
+#define MICRO_ITERATIONS 20000000
+#define SCRIPT_KEYS 4096
+
+#ifndef YAVM_OBJS_DIR
+#define YAVM_OBJS_DIR "objs"
+#endif
+
+typedef void (*handler_fn)(struct lc3_vm *vm, const struct lc3_decoded *d);
+
+struct micro_case {
+    const char *name;
+    handler_fn handler;
+    uint16_t instruction;
+};
+
+// R2 and the word at PC hold 0x5000, so every load and store stays in plain RAM
+static const struct micro_case microCases[] = {
+        {"add", add, 0x1283},       // ADD R1, R2, R3
+        {"addImm", addImm, 0x12A5}, // ADD R1, R2, #5
+        {"and", and, 0x5283},       // AND R1, R2, R3
+        {"andImm", andImm, 0x52BF}, // AND R1, R2, #-1
+        {"not", not, 0x927F},       // NOT R1, R1
+        {"br", br, 0x0E00},         // BRnzp #0
+        {"jmp", jmp, 0xC080},       // JMP R2
+        {"jsr", jsr, 0x4800},       // JSR #0
+        {"jsrr", jsrr, 0x4080},     // JSRR R2
+        {"ld", ld, 0x2200},         // LD R1, #0
+        {"ldi", ldi, 0xA200},       // LDI R1, #0
+        {"ldr", ldr, 0x6280},       // LDR R1, R2, #0
+        {"lea", lea, 0xE200},       // LEA R1, #0
+        {"st", st, 0x3200},         // ST R1, #0
+        {"sti", sti, 0xB200},       // STI R1, #0
+        {"str", str, 0x7280},       // STR R1, R2, #0
+};
+
+struct micro_result {
+    const char *name;
+    double nsPerOp;
+};
+
+struct e2e_result {
+    const char *image;
+    const char *engine;
+    uint64_t instructions;
+    double seconds;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void resetMicroVm(struct lc3_vm *vm) {
+    vm->registers[R_PC] = 0x5000;
+    vm->registers[R_R2] = 0x5000;
+    vm->registers[R_R3] = 0x1234;
+    memoryWrite(vm, 0x5000, 0x5000);
+}
+
+static double timeHandler(struct lc3_vm *vm, handler_fn handler, const struct lc3_decoded *d) {
+    double best = 1e30;
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        resetMicroVm(vm);
+        double start = now();
+        for (int i = 0; i < MICRO_ITERATIONS; ++i) {
+            handler(vm, d);
+        }
+        double elapsed = now() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    return best / MICRO_ITERATIONS * 1e9;
+}
+
+static double timeMemory(struct lc3_vm *vm, int write, uint16_t address) {
+    double best = 1e30;
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        uint16_t sum = 0;
+        double start = now();
+        for (int i = 0; i < MICRO_ITERATIONS; ++i) {
+            if (write) {
+                memoryWrite(vm, address, (uint16_t) i);
+            } else {
+                sum += memoryRead(vm, address);
+            }
+        }
+        double elapsed = now() - start;
+        vm->registers[R_R0] = sum;
+        best = elapsed < best ? elapsed : best;
+    }
+    return best / MICRO_ITERATIONS * 1e9;
+}
+
+// a stream of DECODE_STREAM instruction words for timeDecode(), the index wraps around
+#define DECODE_STREAM 0x10000
+
+static double timeDecode(const uint16_t *words, int table) {
+    double best = 1e30;
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        uint32_t sum = 0;
+        double start = now();
+        for (int i = 0; i < MICRO_ITERATIONS; ++i) {
+            uint16_t word = words[i & (DECODE_STREAM - 1)];
+            struct lc3_decoded d = table ? decode(word) : decodeWord(word);
+            sum += d.handler + d.dr + d.sr1 + d.sr2 + d.imm;
+        }
+        double elapsed = now() - start;
+        best = elapsed < best ? elapsed : best;
+        // keeps the loop from being optimised away
+        if (sum == 1) {
+            printf(" ");
+        }
+    }
+    return best / MICRO_ITERATIONS * 1e9;
+}
+
+/*
+    decodeTable[] lookups against decodeWord() on the code of 2048 repeated, a few KB of the table in cache,
+    and on random words, which touch all of its 384 KB.
+*/
+static int runDecodeMicro(struct micro_result *results, const char *imagePath) {
+    static uint16_t imageWords[DECODE_STREAM], randomWords[DECODE_STREAM];
+    struct lc3_vm *vm = createVm();
+    readImageFile(vm, imagePath);
+    uint32_t end = 0x3000;
+    for (uint32_t address = 0x3000; address < UINT16_MAX; ++address) {
+        end = memoryPeek(vm, (uint16_t) address) ? address + 1 : end;
+    }
+    uint32_t state = 12345;
+    for (uint32_t i = 0; i < DECODE_STREAM; ++i) {
+        imageWords[i] = memoryPeek(vm, (uint16_t) (0x3000 + i % (end - 0x3000)));
+        state = state * 1103515245u + 12345u;
+        randomWords[i] = (uint16_t) (state >> 8);
+    }
+    destroyVm(vm);
+
+    results[0] = (struct micro_result) {"decodeWord(image)", timeDecode(imageWords, 0)};
+    results[1] = (struct micro_result) {"decodeTable(image)", timeDecode(imageWords, 1)};
+    results[2] = (struct micro_result) {"decodeWord(random)", timeDecode(randomWords, 0)};
+    results[3] = (struct micro_result) {"decodeTable(random)", timeDecode(randomWords, 1)};
+    return 4;
+}
+
+static int runMicro(struct micro_result *results) {
+    struct lc3_vm *vm = createVm();
+    int count = 0;
+    for (size_t i = 0; i < sizeof(microCases) / sizeof(microCases[0]); ++i) {
+        struct lc3_decoded d = decode(microCases[i].instruction);
+        results[count++] = (struct micro_result) {microCases[i].name,
+                                                  timeHandler(vm, microCases[i].handler, &d)};
+    }
+    results[count++] = (struct micro_result) {"memoryRead", timeMemory(vm, 0, 0x5000)};
+    results[count++] = (struct micro_result) {"memoryRead(DSR)", timeMemory(vm, 0, MR_DSR)};
+    results[count++] = (struct micro_result) {"memoryWrite", timeMemory(vm, 1, 0x5000)};
+    destroyVm(vm);
+    return count;
+}
+
+// a pseudo-random w/a/s/d sequence, the same for the same seed
+static void fillScript(char *script, uint32_t seed) {
+    static const char keys[] = "wasd";
+    uint32_t state = seed;
+    for (int i = 0; i < SCRIPT_KEYS; ++i) {
+        state = state * 1103515245u + 12345u;
+        script[i] = keys[(state >> 16) & 3];
+    }
+}
+
+// the same sequence on every run, terminated by end of input
+static void writeScript(const char *path) {
+    char script[SCRIPT_KEYS];
+    fillScript(script, 12345);
+    FILE *file = fopen(path, "wb");
+    if (!file || fwrite(script, 1, sizeof(script), file) != sizeof(script)) {
+        printf("Failed to write %s\n", path);
+        exit(-1);
+    }
+    fclose(file);
+}
+
+static struct e2e_result runImage(const char *image, const char *path, const char *script, int jit,
+                                  uint64_t instructions) {
+    struct e2e_result result = {image, jit ? "jit" : "interpreter", 0, 1e30};
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        struct lc3_vm *vm = createVm();
+        readImageFile(vm, path);
+        vm->keyboard.fd = open(script, O_RDONLY);
+        vm->outputFd = open("/dev/null", O_WRONLY);
+        if (vm->keyboard.fd < 0 || vm->outputFd < 0) {
+            printf("Failed to open the benchmark input or output\n");
+            exit(-1);
+        }
+#ifdef YAVM_JIT
+        if (jit) {
+            jitInit(vm);
+        }
+#endif
+        double start = now();
+        startVm(vm);
+        runVm(vm, instructions);
+        double elapsed = now() - start;
+
+        result.instructions = vm->instructionCount;
+        result.seconds = elapsed < result.seconds ? elapsed : result.seconds;
+        close(vm->keyboard.fd);
+        int outputFd = vm->outputFd;
+        destroyVm(vm);
+        close(outputFd);
+    }
+    return result;
+}
+
+// every lane plays its own script, `instructions` is split evenly between them
+static struct e2e_result runLockstep(const char *image, const char *path, uint64_t instructions) {
+    static char scripts[LOCKSTEP_LANES][SCRIPT_KEYS];
+    for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+        fillScript(scripts[l], 12345 + l);
+    }
+    struct e2e_result result = {image, "lockstep", 0, 1e30};
+    struct lc3_lockstep *ls = lockstepCreate();
+    lockstepLoadImage(ls, path);
+    int outputFd = open("/dev/null", O_WRONLY);
+    if (outputFd < 0) {
+        printf("Failed to open the benchmark output\n");
+        exit(-1);
+    }
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        // written out like the output of the other engines
+        for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+            lockstepStartLane(ls, l, (const uint8_t *) scripts[l], SCRIPT_KEYS, outputFd);
+        }
+        double start = now();
+        result.instructions = lockstepRun(ls, instructions / LOCKSTEP_LANES);
+        double elapsed = now() - start;
+        result.seconds = elapsed < result.seconds ? elapsed : result.seconds;
+    }
+    lockstepDestroy(ls);
+    close(outputFd);
+    return result;
+}
+
+static void writeReport(const char *path, const struct micro_result *micro, int microCount,
+                        const struct e2e_result *e2e, int e2eCount) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        printf("Failed to write %s\n", path);
+        exit(-1);
+    }
+#ifdef YAVM_THREADED_DISPATCH
+    const char *dispatch = "threaded";
+#else
+    const char *dispatch = "switch";
+#endif
+    fprintf(file, "{\n  \"version\": 1,\n  \"dispatch\": \"%s\",\n  \"micro\": [\n", dispatch);
+    for (int i = 0; i < microCount; ++i) {
+        fprintf(file, "    {\"name\": \"%s\", \"ns_per_op\": %.3f}%s\n", micro[i].name, micro[i].nsPerOp,
+                i + 1 < microCount ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"end_to_end\": [\n");
+    for (int i = 0; i < e2eCount; ++i) {
+        fprintf(file, "    {\"image\": \"%s\", \"engine\": \"%s\", \"instructions\": %" PRIu64
+                      ", \"seconds\": %.6f, \"instructions_per_second\": %.0f, \"ns_per_instruction\": %.3f}%s\n",
+                e2e[i].image, e2e[i].engine, e2e[i].instructions, e2e[i].seconds,
+                (double) e2e[i].instructions / e2e[i].seconds, e2e[i].seconds * 1e9 / (double) e2e[i].instructions,
+                i + 1 < e2eCount ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+    const char *report = NULL;
+    const char *objsDir = YAVM_OBJS_DIR;
+    uint64_t instructions = 200000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:d:n:")) != -1) {
+        switch (opt) {
+            case 'o':
+                report = optarg;
+                break;
+            case 'd':
+                objsDir = optarg;
+                break;
+            case 'n':
+                instructions = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: ./vm_bench [-o <report.json>] [-d <objs dir>] [-n <instructions>]\n");
+                exit(1);
+        }
+    }
+
+    struct micro_result micro[32];
+    int microCount = runMicro(micro);
+    char decodeImage[4096];
+    snprintf(decodeImage, sizeof(decodeImage), "%s/2048.obj", objsDir);
+    microCount += runDecodeMicro(micro + microCount, decodeImage);
+    printf("%-20s %10s\n", "handler", "ns/op");
+    for (int i = 0; i < microCount; ++i) {
+        printf("%-20s %10.3f\n", micro[i].name, micro[i].nsPerOp);
+    }
+
+    char script[] = "/tmp/yavm_bench_XXXXXX";
+    int scriptFd = mkstemp(script);
+    if (scriptFd < 0) {
+        printf("Failed to create the input script\n");
+        exit(-1);
+    }
+    close(scriptFd);
+    writeScript(script);
+
+    static const char *images[] = {"2048", "rogue"};
+    struct e2e_result e2e[6];
+    int e2eCount = 0;
+    for (int i = 0; i < 2; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.obj", objsDir, images[i]);
+        e2e[e2eCount++] = runImage(images[i], path, script, 0, instructions);
+#ifdef YAVM_JIT
+        e2e[e2eCount++] = runImage(images[i], path, script, 1, instructions);
+#endif
+        e2e[e2eCount++] = runLockstep(images[i], path, instructions);
+    }
+    unlink(script);
+
+    printf("\n%-8s %-12s %14s %10s %12s %10s\n", "image", "engine", "instructions", "seconds", "M instr/s",
+           "ns/instr");
+    for (int i = 0; i < e2eCount; ++i) {
+        printf("%-8s %-12s %14" PRIu64 " %10.3f %12.1f %10.3f\n", e2e[i].image, e2e[i].engine,
+               e2e[i].instructions, e2e[i].seconds, (double) e2e[i].instructions / e2e[i].seconds / 1e6,
+               e2e[i].seconds * 1e9 / (double) e2e[i].instructions);
+    }
+
+    if (report) {
+        writeReport(report, micro, microCount, e2e, e2eCount);
+    }
+}
@@ -0,0 +1,89 @@
+#include "image.h"
+#include "loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// yavm_convert <output.yvm> <image.obj>... : packs big-endian .obj images into one native-endian container
+
+struct segment_data {
+    uint16_t origin;
+    uint32_t count;
+    uint16_t *words;
+};
+
+static void readObj(const char *path, struct segment_data *segment) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Wrong path %s\n", path);
+        exit(-1);
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < 2) {
+        printf("Image %s has no origin\n", path);
+        exit(-1);
+    }
+    uint8_t *bytes = malloc(size);
+    if (!bytes || fread(bytes, 1, size, file) != (size_t) size) {
+        printf("Failed to read %s\n", path);
+        exit(-1);
+    }
+    fclose(file);
+
+    segment->origin = (uint16_t) (bytes[0] << 8 | bytes[1]);
+    segment->count = (uint32_t) ((size - 2) / 2);
+    if (segment->count > 0x10000u - segment->origin) {
+        segment->count = 0x10000u - segment->origin;
+    }
+    segment->words = malloc(segment->count * sizeof(uint16_t) + 1);
+    swapWords(segment->words, bytes + 2, segment->count);
+    free(bytes);
+}
+
+static uint64_t alignUp(uint64_t x) {
+    return (x + YAVM_IMAGE_ALIGN - 1) & ~(uint64_t) (YAVM_IMAGE_ALIGN - 1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: ./yavm_convert <output.yvm> <image.obj>...\n");
+        exit(1);
+    }
+    uint32_t count = (uint32_t) (argc - 2);
+    struct segment_data *segments = calloc(count, sizeof(struct segment_data));
+    struct yavm_image_segment *table = calloc(count, sizeof(struct yavm_image_segment));
+
+    uint64_t offset = alignUp(sizeof(struct yavm_image_header) + count * sizeof(struct yavm_image_segment));
+    for (uint32_t i = 0; i < count; ++i) {
+        readObj(argv[i + 2], &segments[i]);
+        table[i].origin = segments[i].origin;
+        table[i].count = segments[i].count;
+        table[i].offset = offset;
+        offset = alignUp(offset + segments[i].count * sizeof(uint16_t));
+    }
+
+    struct yavm_image_header header = {{0}, YAVM_IMAGE_VERSION, YAVM_IMAGE_BYTE_ORDER, count, 0};
+    memcpy(header.magic, YAVM_IMAGE_MAGIC, 4);
+
+    FILE *out = fopen(argv[1], "wb");
+    if (!out) {
+        printf("Failed to create %s\n", argv[1]);
+        exit(-1);
+    }
+    static const uint8_t padding[YAVM_IMAGE_ALIGN];
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(table, sizeof(struct yavm_image_segment), count, out);
+    for (uint32_t i = 0; i < count; ++i) {
+        fwrite(padding, 1, table[i].offset - ftell(out), out);
+        fwrite(segments[i].words, sizeof(uint16_t), segments[i].count, out);
+        free(segments[i].words);
+    }
+    if (ferror(out) || fclose(out) != 0) {
+        printf("Failed to write %s\n", argv[1]);
+        exit(-1);
+    }
+    free(segments);
+    free(table);
+}
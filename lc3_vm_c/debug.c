@@ -0,0 +1,154 @@
+#include "debug.h"
+#include <string.h>
+
+static struct lc3_debug *attach(struct lc3_vm *vm) {
+    if (!vm->debug) {
+        vm->debug = calloc(1, sizeof(struct lc3_debug));
+        if (!vm->debug) {
+            printf("Unable to allocate debugger state");
+            exit(-1);
+        }
+    }
+    return vm->debug;
+}
+
+void debugSetBreakpoint(struct lc3_vm *vm, uint16_t address, int enabled) {
+    struct lc3_debug *debug = attach(vm);
+    if (debug->breakpoint[address] != !!enabled) {
+        debug->breakpoint[address] = (uint8_t) !!enabled;
+        debug->breakpointCount += enabled ? 1 : -1;
+    }
+}
+
+static void markPages(struct lc3_debug *debug, struct debug_watch watch, int delta) {
+    for (uint32_t page = watch.start >> DEBUG_PAGE_SHIFT; page <= (uint32_t) (watch.end >> DEBUG_PAGE_SHIFT); ++page) {
+        debug->watchedPage[page] += delta;
+    }
+}
+
+int debugWatch(struct lc3_vm *vm, uint16_t start, uint16_t end, int enabled) {
+    struct lc3_debug *debug = attach(vm);
+    struct debug_watch watch = {start, end};
+    if (enabled) {
+        if (end < start || debug->watchCount == DEBUG_MAX_WATCHES) {
+            return 0;
+        }
+        debug->watches[debug->watchCount++] = watch;
+        markPages(debug, watch, 1);
+        return 1;
+    }
+    for (int i = 0; i < debug->watchCount; ++i) {
+        if (debug->watches[i].start == start && debug->watches[i].end == end) {
+            markPages(debug, watch, -1);
+            debug->watches[i] = debug->watches[--debug->watchCount];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void debugDestroy(struct lc3_vm *vm) {
+    free(vm->debug);
+    vm->debug = NULL;
+}
+
+static const char *const conditions[8] = {"-", "P", "Z", "ZP", "N", "NP", "NZ", "NZP"};
+
+static void printRegisters(struct lc3_vm *vm) {
+    const uint16_t *r = vm->registers;
+    fprintf(stderr, "R0 %04X  R1 %04X  R2 %04X  R3 %04X  R4 %04X  R5 %04X  R6 %04X  R7 %04X\n",
+            r[R_R0], r[R_R1], r[R_R2], r[R_R3], r[R_R4], r[R_R5], r[R_R6], r[R_R7]);
+    fprintf(stderr, "PC %04X  COND %s  next %04X  %" PRIu64 " instructions\n", r[R_PC],
+            conditions[conditionFlags(r[R_COND])], memoryPeek(vm, r[R_PC]), vm->instructionCount);
+}
+
+static void printMemory(struct lc3_vm *vm, uint16_t address, uint32_t count) {
+    for (uint32_t i = 0; i < count && address + i < 0x10000; ++i) {
+        if (i % 8 == 0) {
+            fprintf(stderr, "%s%04X:", i ? "\n" : "", address + i);
+        }
+        fprintf(stderr, " %04X", memoryPeek(vm, (uint16_t) (address + i)));
+    }
+    fprintf(stderr, "\n");
+}
+
+// one line from fd 0, read byte by byte so nothing the guest reads afterwards gets buffered away
+static int readLine(char *line, size_t size) {
+    size_t length = 0;
+    char c;
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+        if (c == '\n' || c == '\r') {
+            line[length] = 0;
+            return 1;
+        }
+        if (length + 1 < size) {
+            line[length++] = c;
+        }
+    }
+    line[length] = 0;
+    return length > 0;
+}
+
+#define DEBUG_HELP "c                continue\n" \
+                   "s [n]            run n instructions, 1 by default\n" \
+                   "b <addr>         set a breakpoint\n" \
+                   "d <addr>         delete a breakpoint\n" \
+                   "w <addr> [end]   watch stores into addr..end\n" \
+                   "u <addr> [end]   remove that watch\n" \
+                   "r                registers\n" \
+                   "x <addr> [n]     n words of memory, 8 by default\n" \
+                   "q                quit\n"
+
+int64_t debugPrompt(struct lc3_vm *vm) {
+    struct lc3_debug *debug = vm->debug;
+    flushOutput(vm);
+    if (debug && debug->watchHit) {
+        fprintf(stderr, "\nwatch: [%04X] %04X -> %04X\n", debug->hitAddress, debug->oldValue, debug->newValue);
+    }
+    printRegisters(vm);
+    // the guest may have the terminal in raw mode
+    restoreInputBuffering(vm);
+    char line[128];
+    int64_t run = -1;
+    for (;;) {
+        fprintf(stderr, "(yavm) ");
+        if (!readLine(line, sizeof(line))) {
+            break;
+        }
+        // addresses are hex, counts decimal
+        char command = 0;
+        unsigned a = 0, b = 0;
+        if (sscanf(line, " %c", &command) != 1) {
+            continue;
+        }
+        const char *args = strchr(line, command) + 1;
+        int fields = command == 's' ? sscanf(args, "%u", &a) :
+                     command == 'x' ? sscanf(args, "%x %u", &a, &b) : sscanf(args, "%x %x", &a, &b);
+        if (command == 'c') {
+            run = 0;
+            break;
+        } else if (command == 's') {
+            run = fields >= 1 && a > 0 ? a : 1;
+            break;
+        } else if (command == 'q') {
+            break;
+        } else if (command == 'r') {
+            printRegisters(vm);
+        } else if ((command == 'b' || command == 'd') && fields >= 1) {
+            debugSetBreakpoint(vm, (uint16_t) a, command == 'b');
+        } else if ((command == 'w' || command == 'u') && fields >= 1) {
+            uint16_t end = (uint16_t) (fields >= 2 ? b : a);
+            if (end < (uint16_t) a) {
+                fprintf(stderr, "watch ends at %04X before it starts at %04X\n", end, (uint16_t) a);
+            } else if (!debugWatch(vm, (uint16_t) a, end, command == 'w')) {
+                fprintf(stderr, command == 'w' ? "too many watches\n" : "no such watch\n");
+            }
+        } else if (command == 'x' && fields >= 1) {
+            printMemory(vm, (uint16_t) a, fields >= 2 ? b : 8);
+        } else {
+            fprintf(stderr, DEBUG_HELP);
+        }
+    }
+    disableInputBuffering(vm);
+    return run;
+}
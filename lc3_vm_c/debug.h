@@ -0,0 +1,66 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    Breakpoints and write watchpoints. While any of them is set runVm() uses the instrumented loop instead
+    of the regular dispatch loop and the JIT, so guests that are not being debugged run the unchanged fast
+    paths and memoryWrite() stays free of checks.
+
+    A breakpoint stops the guest before the instruction at its address, like breakPc does. A watchpoint
+    covers an inclusive address range and stops the guest right after a store into it, with the address
+    and the old and new value in the hit. Stores are first filtered by 256-word page, so only stores into a
+    page with a watchpoint look at the ranges. Both make runVm() return VM_BREAK.
+*/
+
+#define DEBUG_MAX_WATCHES 64
+#define DEBUG_PAGE_SHIFT 8
+
+struct debug_watch {
+    uint16_t start;
+    uint16_t end;
+};
+
+struct lc3_debug {
+    uint8_t breakpoint[0x10000];
+    int breakpointCount;
+    struct debug_watch watches[DEBUG_MAX_WATCHES];
+    int watchCount;
+    uint8_t watchedPage[0x10000 >> DEBUG_PAGE_SHIFT]; // number of watches touching the page
+
+    // the last watchpoint hit, valid while watchHit is set
+    int watchHit;
+    uint16_t hitAddress;
+    uint16_t oldValue;
+    uint16_t newValue;
+};
+
+// both attach vm->debug on first use
+void debugSetBreakpoint(struct lc3_vm *vm, uint16_t address, int enabled);
+
+// returns 0 for end < start or if all DEBUG_MAX_WATCHES are taken, removing takes the exact range that was added
+int debugWatch(struct lc3_vm *vm, uint16_t start, uint16_t end, int enabled);
+
+void debugDestroy(struct lc3_vm *vm);
+
+static inline int debugActive(const struct lc3_debug *debug) {
+    return debug && (debug->breakpointCount || debug->watchCount);
+}
+
+static inline int debugWatched(const struct lc3_debug *debug, uint16_t address) {
+    if (!debug->watchedPage[address >> DEBUG_PAGE_SHIFT]) {
+        return 0;
+    }
+    for (int i = 0; i < debug->watchCount; ++i) {
+        if (debug->watches[i].start <= address && address <= debug->watches[i].end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Interactive prompt on stdin/stderr for a guest that stopped. Returns how many instructions to run before
+    the next prompt, 0 to run until the next hit or HALT, or -1 to quit.
+*/
+int64_t debugPrompt(struct lc3_vm *vm);
@@ -0,0 +1,95 @@
+#include "vm.h"
+
+uint16_t signExtend(uint16_t x, int bit_count) {
+    if ((x >> (bit_count - 1)) & 0x1) {
+        x |= (0xFFFF << bit_count);
+    }
+    return x;
+}
+
+//Add instruction
+/*
+    Two cases:
+    First:
+        ===========================================================
+        |0xF...0xC| 0xB...0x9|0x8...0x6|  0x5 |0x4...0x3|0x2...0x0|
+        |   0001  |    DR    |   SR1   |   0  |    00   |  SR2    |
+        ===========================================================
+   Second:
+        =================================================
+        |0xF...0xC| 0xB...0x9|0x8...0x6|  0x5 |0x4...0x0|
+        |   0001  |    DR    |   SR1   |   1  |    imm5 |
+        =================================================
+    Every other format keeps DR/SR (or the nzp mask of BR) in 0xB...0x9 and SR1/BaseR in 0x8...0x6, so
+    those are extracted unconditionally and only the offset width depends on the opcode.
+*/
+struct lc3_decoded decodeWord(uint16_t instruction) {
+    struct lc3_decoded d;
+    d.handler = D_NOP;
+    d.dr = (instruction >> 9) & 0x7;
+    d.sr1 = (instruction >> 6) & 0x7;
+    d.sr2 = instruction & 0x7;
+    d.imm = 0;
+
+    switch (instruction >> 12) {
+        case OP_ADD:
+            d.handler = ((instruction >> 5) & 0x1) ? D_ADD_IMM : D_ADD;
+            d.imm = signExtend(instruction & 0x1F, 5);
+            break;
+        case OP_AND:
+            d.handler = ((instruction >> 5) & 0x1) ? D_AND_IMM : D_AND;
+            d.imm = signExtend(instruction & 0x1F, 5);
+            break;
+        case OP_BR:
+            d.handler = D_BR;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_JMP:
+            d.handler = D_JMP;
+            break;
+        case OP_JSR:
+            if ((instruction >> 0xB) & 0x1) {
+                d.handler = D_JSR;
+                d.imm = signExtend(instruction & 0x7FF, 11);
+            } else {
+                d.handler = D_JSRR;
+            }
+            break;
+        case OP_LD:
+            d.handler = D_LD;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_LDI:
+            d.handler = D_LDI;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_LDR:
+            d.handler = D_LDR;
+            d.imm = signExtend(instruction & 0x3F, 6);
+            break;
+        case OP_LEA:
+            d.handler = D_LEA;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_NOT:
+            d.handler = D_NOT;
+            break;
+        case OP_ST:
+            d.handler = D_ST;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_STI:
+            d.handler = D_STI;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_STR:
+            d.handler = D_STR;
+            d.imm = signExtend(instruction & 0x3F, 6);
+            break;
+        case OP_TRAP:
+            d.handler = D_TRAP;
+            d.imm = instruction & 0xFF;
+            break;
+    }
+    return d;
+}
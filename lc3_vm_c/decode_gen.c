@@ -0,0 +1,29 @@
+#include "vm.h"
+
+/*
+    yavm_decode_gen <output.c> : writes decodeTable[], decodeWord() of every one of the 65536 instruction
+    words. The build runs it once and compiles the result into the VM, so decode() is a single indexed load.
+*/
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("Usage: ./yavm_decode_gen <output.c>\n");
+        exit(1);
+    }
+    FILE *out = fopen(argv[1], "w");
+    if (!out) {
+        printf("Failed to create %s\n", argv[1]);
+        exit(-1);
+    }
+    fprintf(out, "// generated by yavm_decode_gen, do not edit\n\n#include \"vm.h\"\n\n");
+    fprintf(out, "const struct lc3_decoded decodeTable[0x10000] = {\n");
+    for (uint32_t word = 0; word < 0x10000; ++word) {
+        struct lc3_decoded d = decodeWord((uint16_t) word);
+        fprintf(out, "        {%u, %u, %u, %u, 0x%04X}, // %04X\n", d.handler, d.dr, d.sr1, d.sr2, d.imm, word);
+    }
+    fprintf(out, "};\n");
+    if (ferror(out) || fclose(out) != 0) {
+        printf("Failed to write %s\n", argv[1]);
+        exit(-1);
+    }
+}
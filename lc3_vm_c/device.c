@@ -0,0 +1,86 @@
+#include "device.h"
+
+#ifdef YAVM_JIT
+#include "jit.h"
+#endif
+
+static int touchesPage(const struct lc3_device *device, uint32_t page) {
+    return device->start >> PAGE_SHIFT <= page && page <= (uint32_t) (device->end >> PAGE_SHIFT);
+}
+
+static void mapDevices(struct lc3_vm *vm) {
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        struct lc3_device *device = vm->devices;
+        while (device && !touchesPage(device, page)) {
+            device = device->next;
+        }
+        if (vm->devicePages[page] != device) {
+            vm->devicePages[page] = device;
+            // code predecoded on the page was fetched from memory, or not cached at all while it had a device
+            invalidateDecoded(vm, (uint16_t) (page << PAGE_SHIFT), PAGE_WORDS);
+        }
+    }
+#ifdef YAVM_JIT
+    // translated code reads memory inline on pages that had no device when it was translated
+    if (vm->jit) {
+        jitDestroy(vm);
+        jitInit(vm);
+    }
+#endif
+}
+
+struct lc3_device *deviceAdd(struct lc3_vm *vm, uint16_t start, uint16_t end, device_read_fn read,
+                             device_write_fn write, void *data) {
+    struct lc3_device *device = malloc(sizeof(struct lc3_device));
+    if (!device) {
+        printf("Unable to allocate a device");
+        exit(-1);
+    }
+    *device = (struct lc3_device) {start, end, read, write, data, vm->devices};
+    vm->devices = device;
+    mapDevices(vm);
+    return device;
+}
+
+void deviceRemove(struct lc3_vm *vm, struct lc3_device *device) {
+    struct lc3_device **link = &vm->devices;
+    while (*link && *link != device) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = device->next;
+        free(device);
+        mapDevices(vm);
+    }
+}
+
+void deviceDestroy(struct lc3_vm *vm) {
+    while (vm->devices) {
+        struct lc3_device *device = vm->devices;
+        vm->devices = device->next;
+        free(device);
+    }
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        vm->devicePages[page] = NULL;
+    }
+}
+
+int deviceRead(struct lc3_vm *vm, uint16_t address, uint16_t *value) {
+    for (struct lc3_device *device = vm->devicePages[address >> PAGE_SHIFT]; device; device = device->next) {
+        if (device->read && device->start <= address && address <= device->end &&
+            device->read(device->data, address, value)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int deviceWrite(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    for (struct lc3_device *device = vm->devicePages[address >> PAGE_SHIFT]; device; device = device->next) {
+        if (device->write && device->start <= address && address <= device->end &&
+            device->write(device->data, address, value)) {
+            return 1;
+        }
+    }
+    return 0;
+}
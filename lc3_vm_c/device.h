@@ -0,0 +1,41 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    Memory-mapped devices. A device claims an inclusive address range of one guest, and loads and stores in
+    it go to its callbacks before plain memory. A callback returns 1 if it took care of the access and 0 to
+    pass it on to the next device claiming the address or, after the last one, to plain memory. Newer
+    devices come first.
+
+    vm->devicePages holds the first device touching each page and NULL for pages without one, so a load or
+    store on plain memory costs a single table lookup however many devices there are. Every guest starts
+    with the console (KBSR, KBDR, DSR and DDR).
+
+    Devices are meant to be set up before the guest runs. Adding or removing one drops the code the JIT has
+    translated so far, so it must not happen from inside a callback of a JIT guest.
+*/
+
+typedef int (*device_read_fn)(void *data, uint16_t address, uint16_t *value);
+typedef int (*device_write_fn)(void *data, uint16_t address, uint16_t value);
+
+struct lc3_device {
+    uint16_t start;
+    uint16_t end;
+    device_read_fn read;   // NULL to leave loads alone
+    device_write_fn write; // NULL to leave stores alone
+    void *data;
+    struct lc3_device *next; // next older device of the guest
+};
+
+struct lc3_device *deviceAdd(struct lc3_vm *vm, uint16_t start, uint16_t end, device_read_fn read,
+                             device_write_fn write, void *data);
+
+void deviceRemove(struct lc3_vm *vm, struct lc3_device *device);
+
+void deviceDestroy(struct lc3_vm *vm);
+
+// the slow paths of memoryRead() and memoryWrite() for pages with a device, 0 if none took the access
+int deviceRead(struct lc3_vm *vm, uint16_t address, uint16_t *value);
+
+int deviceWrite(struct lc3_vm *vm, uint16_t address, uint16_t value);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+    .yvm container format, version 1.
+
+    A header, a table of segmentCount segments right after it, then the payloads. Every field and every
+    payload word is in the byte order of the machine that wrote the file, byteOrder tells the loader whether
+    that matches its own. Payloads start on a YAVM_IMAGE_ALIGN boundary, so a mapped file can be copied
+    (or later shared) without touching each word. Segments are loaded in table order and may overlap.
+
+    yavm_convert builds one from one or more big-endian .obj images, one segment each.
+*/
+
+#define YAVM_IMAGE_MAGIC "YVMI"
+#define YAVM_IMAGE_VERSION 1
+#define YAVM_IMAGE_BYTE_ORDER 0x0102
+#define YAVM_IMAGE_ALIGN 64
+
+struct yavm_image_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t byteOrder;
+    uint32_t segmentCount;
+    uint32_t reserved;
+};
+
+struct yavm_image_segment {
+    uint16_t origin;
+    uint16_t reserved;
+    uint32_t count;  // words
+    uint64_t offset; // of the payload, from the start of the file
+};
@@ -0,0 +1,540 @@
+#include "jit.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (4 << 20)
+// upper bound of the native code one block can take, checked before a translation starts
+#define JIT_MAX_BLOCK_CODE (JIT_MAX_BLOCK_LENGTH * 128 + 128)
+
+/*
+    Register assignment inside translated code:
+        rbx - guest registers[], R_PC at +16, R_COND at +18
+        r12 - guest pages[], see memoryPeek()
+        r13 - blockAt[], native entry per guest address
+        r14 - counter[2], retired instructions and the limit
+        r15 - the struct lc3_vm, first argument of every helper
+    All of them are callee-saved, so helpers can be called without spilling anything.
+*/
+#define REG_DISP(r) ((uint8_t) ((r) * 2))
+
+static void emit8(struct lc3_jit *jit, uint8_t x) {
+    *jit->cursor++ = x;
+}
+
+static void emit16(struct lc3_jit *jit, uint16_t x) {
+    memcpy(jit->cursor, &x, sizeof(x));
+    jit->cursor += sizeof(x);
+}
+
+static void emit32(struct lc3_jit *jit, uint32_t x) {
+    memcpy(jit->cursor, &x, sizeof(x));
+    jit->cursor += sizeof(x);
+}
+
+static void emit64(struct lc3_jit *jit, uint64_t x) {
+    memcpy(jit->cursor, &x, sizeof(x));
+    jit->cursor += sizeof(x);
+}
+
+static void emitBytes(struct lc3_jit *jit, const uint8_t *bytes, size_t count) {
+    memcpy(jit->cursor, bytes, count);
+    jit->cursor += count;
+}
+
+static void patchRel32(uint8_t *at, const uint8_t *target) {
+    int32_t rel = (int32_t) (target - (at + 4));
+    memcpy(at, &rel, sizeof(rel));
+}
+
+// jmp rel32 to epilogue
+static void emitJumpToEpilogue(struct lc3_jit *jit) {
+    emit8(jit, 0xE9);
+    emit32(jit, 0);
+    patchRel32(jit->cursor - 4, jit->epilogue);
+}
+
+// movzx eax, word [rbx + 2*r]
+static void emitLoadRegEax(struct lc3_jit *jit, uint8_t r) {
+    emitBytes(jit, (const uint8_t[]) {0x0F, 0xB7, 0x43, REG_DISP(r)}, 4);
+}
+
+// movzx ecx, word [rbx + 2*r]
+static void emitLoadRegEcx(struct lc3_jit *jit, uint8_t r) {
+    emitBytes(jit, (const uint8_t[]) {0x0F, 0xB7, 0x4B, REG_DISP(r)}, 4);
+}
+
+// movzx edx, word [rbx + 2*r]
+static void emitLoadRegEdx(struct lc3_jit *jit, uint8_t r) {
+    emitBytes(jit, (const uint8_t[]) {0x0F, 0xB7, 0x53, REG_DISP(r)}, 4);
+}
+
+// mov word [rbx + 2*r], ax
+static void emitStoreRegAx(struct lc3_jit *jit, uint8_t r) {
+    emitBytes(jit, (const uint8_t[]) {0x66, 0x89, 0x43, REG_DISP(r)}, 4);
+}
+
+// mov word [rbx + 2*r], imm16
+static void emitStoreRegImm(struct lc3_jit *jit, uint8_t r, uint16_t value) {
+    emitBytes(jit, (const uint8_t[]) {0x66, 0xC7, 0x43, REG_DISP(r)}, 4);
+    emit16(jit, value);
+}
+
+// movzx eax, ax
+static void emitZeroExtendAx(struct lc3_jit *jit) {
+    emitBytes(jit, (const uint8_t[]) {0x0F, 0xB7, 0xC0}, 3);
+}
+
+// mov rdi, r15 ; mov rax, fn ; call rax
+static void emitCall(struct lc3_jit *jit, const void *fn) {
+    emitBytes(jit, (const uint8_t[]) {0x4C, 0x89, 0xFF}, 3);
+    emit8(jit, 0x48);
+    emit8(jit, 0xB8);
+    emit64(jit, (uint64_t) (uintptr_t) fn);
+    emitBytes(jit, (const uint8_t[]) {0xFF, 0xD0}, 2);
+}
+
+// jcc rel32 opcode taking a BR with this nzp mask after cmp word [rbx + R_COND], 0, see conditionFlags()
+static const uint8_t branchCondition[8] = {
+        [FL_NEG] = 0x8C,          // jl
+        [FL_ZR] = 0x84,           // je
+        [FL_POS] = 0x8F,          // jg
+        [FL_NEG | FL_ZR] = 0x8E,  // jle
+        [FL_NEG | FL_POS] = 0x85, // jne
+        [FL_ZR | FL_POS] = 0x8D,  // jge
+};
+
+// eax = memoryRead(vm, address) for an address known at translation time
+static void emitLoadConst(struct lc3_jit *jit, struct lc3_vm *vm, uint16_t address) {
+    if (!deviceMapped(vm, address)) {
+        // mov rax, [r12 + 8*page] ; movzx eax, word [rax + 2*offset]
+        emitBytes(jit, (const uint8_t[]) {0x49, 0x8B, 0x84, 0x24}, 4);
+        emit32(jit, (uint32_t) (address >> PAGE_SHIFT) * 8);
+        emitBytes(jit, (const uint8_t[]) {0x0F, 0xB7, 0x80}, 3);
+        emit32(jit, (uint32_t) (address & (PAGE_WORDS - 1)) * 2);
+    } else {
+        emit8(jit, 0xBE); // mov esi, address
+        emit32(jit, address);
+        emitCall(jit, memoryRead);
+        emitZeroExtendAx(jit);
+    }
+}
+
+// eax = memoryRead(vm, eax), plain memory inline and pages with a device through the helper
+static void emitLoadDynamic(struct lc3_jit *jit) {
+    emitBytes(jit, (const uint8_t[]) {0x89, 0xC1}, 2);                     // mov ecx, eax
+    emitBytes(jit, (const uint8_t[]) {0xC1, 0xE9, PAGE_SHIFT}, 3);         // shr ecx, PAGE_SHIFT
+    emitBytes(jit, (const uint8_t[]) {0x49, 0x83, 0xBC, 0xCF}, 4);         // cmp qword [r15 + rcx*8 + devicePages], 0
+    emit32(jit, (uint32_t) offsetof(struct lc3_vm, devicePages));
+    emit8(jit, 0);
+    emitBytes(jit, (const uint8_t[]) {0x75, 13}, 2);                       // jne slow
+    emitBytes(jit, (const uint8_t[]) {0x49, 0x8B, 0x0C, 0xCC}, 4);         // mov rcx, [r12 + rcx*8]
+    emitBytes(jit, (const uint8_t[]) {0x0F, 0xB6, 0xC0}, 3);               // movzx eax, al
+    emitBytes(jit, (const uint8_t[]) {0x0F, 0xB7, 0x04, 0x41}, 4);         // movzx eax, word [rcx + rax*2]
+    emitBytes(jit, (const uint8_t[]) {0xEB, 20}, 2);                       // jmp done
+    emitBytes(jit, (const uint8_t[]) {0x89, 0xC6}, 2);                     // slow: mov esi, eax
+    emitCall(jit, memoryRead);
+    emitZeroExtendAx(jit);
+    // done:
+}
+
+// eax = R[r] + offset, wrapped to 16 bits
+static void emitBasePlusOffset(struct lc3_jit *jit, uint8_t r, uint16_t offset) {
+    emitLoadRegEax(jit, r);
+    emit8(jit, 0x05); // add eax, offset
+    emit32(jit, offset);
+    emitZeroExtendAx(jit);
+}
+
+static int jitStore(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    vm->jit->invalidated = 0;
+    memoryWrite(vm, address, value);
+    return vm->jit->invalidated;
+}
+
+/*
+    memoryWrite(vm, esi = address, R[sr]). If the store hit translated code the block may be running stale
+    instructions, so it leaves right after the store with only the first `retired` instructions counted.
+*/
+static void emitStore(struct lc3_jit *jit, uint8_t sr, int retired, int length, uint16_t next) {
+    emitLoadRegEdx(jit, sr);
+    emitCall(jit, jitStore);
+    emitBytes(jit, (const uint8_t[]) {0x85, 0xC0, 0x74, 20}, 4); // test eax, eax ; jz continue
+    emitBytes(jit, (const uint8_t[]) {0x49, 0x81, 0x2E}, 3);     // sub qword [r14], length - retired
+    emit32(jit, (uint32_t) (length - retired));
+    emitStoreRegImm(jit, R_PC, next);
+    emitBytes(jit, (const uint8_t[]) {0x31, 0xC0}, 2);           // xor eax, eax
+    emitJumpToEpilogue(jit);
+    // continue:
+}
+
+static void chain(struct lc3_jit *jit, uint8_t *site, int index) {
+    if (jit->linkCount == JIT_MAX_LINKS) {
+        return;
+    }
+    patchRel32(site + 1, jit->blocks[index].code);
+    jit->links[jit->linkCount].site = site;
+    jit->links[jit->linkCount].next = jit->blocks[index].links;
+    jit->blocks[index].links = jit->linkCount++;
+}
+
+/*
+    Leaves the block towards a guest address known at translation time. The stub stores the new PC and
+    hands its own jmp back to the dispatcher, which patches that jmp into a direct jump to the target block.
+*/
+static void emitExit(struct lc3_jit *jit, uint16_t target) {
+    emitStoreRegImm(jit, R_PC, target);
+    emitBytes(jit, (const uint8_t[]) {0x48, 0x8D, 0x05, 0x00, 0x00, 0x00, 0x00}, 7); // lea rax, [rip]
+    uint8_t *site = jit->cursor;
+    emitJumpToEpilogue(jit);
+    if (jit->blockIndex[target] > 0) {
+        chain(jit, site, jit->blockIndex[target] - 1);
+    }
+}
+
+// PC = eax and jump to the block there if it is already translated
+static void emitIndirectExit(struct lc3_jit *jit) {
+    emitStoreRegAx(jit, R_PC);
+    emitBytes(jit, (const uint8_t[]) {
+            0x49, 0x8B, 0x4C, 0xC5, 0x00, // mov rcx, [r13 + rax*8]
+            0x48, 0x85, 0xC9,             // test rcx, rcx
+            0x74, 0x02,                   // jz miss
+            0xFF, 0xE1,                   // jmp rcx
+            0x31, 0xC0,                   // miss: xor eax, eax
+    }, 14);
+    emitJumpToEpilogue(jit);
+}
+
+static int setsFlags(uint8_t handler) {
+    switch (handler) {
+        case D_ADD:
+        case D_ADD_IMM:
+        case D_AND:
+        case D_AND_IMM:
+        case D_LD:
+        case D_LDI:
+        case D_LDR:
+        case D_LEA:
+        case D_NOT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int isStore(uint8_t handler) {
+    return handler == D_ST || handler == D_STI || handler == D_STR;
+}
+
+static void flush(struct lc3_jit *jit) {
+    jit->cursor = jit->translatedStart;
+    memset(jit->blockAt, 0, sizeof(jit->blockAt));
+    memset(jit->blockIndex, 0, sizeof(jit->blockIndex));
+    memset(jit->codeMap, 0, sizeof(jit->codeMap));
+    jit->blockCount = 0;
+    jit->linkCount = 0;
+    jit->refusalCount = 0;
+}
+
+// remembers that `start` is interpreted, a store into [first, end) may change that. Returns -1 like translate().
+static int refuse(struct lc3_jit *jit, uint16_t start, uint16_t first, uint32_t end) {
+    if (jit->refusalCount < JIT_MAX_REFUSALS) {
+        jit->refusals[jit->refusalCount++] = (struct jit_refusal) {start, first, end};
+        jit->blockIndex[start] = JIT_REFUSED;
+        memset(jit->codeMap + first, 1, end - first);
+    }
+    return -1;
+}
+
+static int translate(struct lc3_vm *vm, uint16_t start) {
+    struct lc3_jit *jit = vm->jit;
+    struct lc3_decoded ins[JIT_MAX_BLOCK_LENGTH];
+    uint8_t needFlags[JIT_MAX_BLOCK_LENGTH];
+    uint32_t pc = start;
+    int length = 0;
+    int terminated = 0;
+
+    while (length < JIT_MAX_BLOCK_LENGTH && pc < 0x10000 && !deviceMapped(vm, pc) && !terminated) {
+        struct lc3_decoded d = decode(memoryPeek(vm, pc));
+        if (d.handler == D_TRAP) {
+            break;
+        }
+        ins[length++] = d;
+        ++pc;
+        terminated = d.handler == D_BR || d.handler == D_JMP || d.handler == D_JSR || d.handler == D_JSRR;
+    }
+    // a TRAP or a device page right at the start, device changes start the JIT over anyway
+    if (length == 0) {
+        return refuse(jit, start, start, start + 1);
+    }
+    // spin loops are left to the interpreter, which waits for input there instead, see brSpin()
+    if (terminated && ins[length - 1].handler == D_BR) {
+        uint16_t target = (uint16_t) (pc + ins[length - 1].imm);
+        if (target <= start && spinLoop(vm, target, (uint16_t) (pc - 1), 0)) {
+            return refuse(jit, start, target, pc);
+        }
+    }
+
+    // only the last flag update before a possible exit is observable, the others are dropped
+    int live = 1;
+    for (int i = length - 1; i >= 0; --i) {
+        if (setsFlags(ins[i].handler)) {
+            needFlags[i] = (uint8_t) live;
+            live = 0;
+        } else if (isStore(ins[i].handler)) {
+            live = 1;
+        }
+    }
+
+    int index = jit->blockCount++;
+    struct jit_block *block = &jit->blocks[index];
+    block->start = start;
+    block->end = pc;
+    block->code = jit->cursor;
+    block->links = -1;
+    block->live = 1;
+
+    // refuse to enter if the whole block does not fit into the instruction limit, else account for all of it
+    emitBytes(jit, (const uint8_t[]) {
+            0x49, 0x8B, 0x06, // mov rax, [r14]
+            0x48, 0x05,       // add rax, length
+    }, 5);
+    emit32(jit, (uint32_t) length);
+    emitBytes(jit, (const uint8_t[]) {
+            0x49, 0x3B, 0x46, 0x08, // cmp rax, [r14 + 8]
+            0x76, 13,               // jbe enter
+    }, 6);
+    emitStoreRegImm(jit, R_PC, start);
+    emitBytes(jit, (const uint8_t[]) {0x31, 0xC0}, 2); // xor eax, eax
+    emitJumpToEpilogue(jit);
+    emitBytes(jit, (const uint8_t[]) {0x49, 0x89, 0x06}, 3); // enter: mov [r14], rax
+
+    for (int i = 0; i < length; ++i) {
+        const struct lc3_decoded *d = &ins[i];
+        uint16_t next = (uint16_t) (start + i + 1);
+        switch (d->handler) {
+            case D_ADD:
+                emitLoadRegEax(jit, d->sr1);
+                emitLoadRegEcx(jit, d->sr2);
+                emitBytes(jit, (const uint8_t[]) {0x01, 0xC8}, 2); // add eax, ecx
+                break;
+            case D_ADD_IMM:
+                emitLoadRegEax(jit, d->sr1);
+                emit8(jit, 0x05); // add eax, imm
+                emit32(jit, d->imm);
+                break;
+            case D_AND:
+                emitLoadRegEax(jit, d->sr1);
+                emitLoadRegEcx(jit, d->sr2);
+                emitBytes(jit, (const uint8_t[]) {0x21, 0xC8}, 2); // and eax, ecx
+                break;
+            case D_AND_IMM:
+                emitLoadRegEax(jit, d->sr1);
+                emit8(jit, 0x25); // and eax, imm
+                emit32(jit, d->imm);
+                break;
+            case D_NOT:
+                emitLoadRegEax(jit, d->sr1);
+                emitBytes(jit, (const uint8_t[]) {0xF7, 0xD0}, 2); // not eax
+                break;
+            case D_LEA:
+                emit8(jit, 0xB8); // mov eax, next + imm
+                emit32(jit, (uint16_t) (next + d->imm));
+                break;
+            case D_LD:
+                emitLoadConst(jit, vm, (uint16_t) (next + d->imm));
+                break;
+            case D_LDI:
+                emitLoadConst(jit, vm, (uint16_t) (next + d->imm));
+                emitLoadDynamic(jit);
+                break;
+            case D_LDR:
+                emitBasePlusOffset(jit, d->sr1, d->imm);
+                emitLoadDynamic(jit);
+                break;
+            case D_ST:
+                emit8(jit, 0xBE); // mov esi, next + imm
+                emit32(jit, (uint16_t) (next + d->imm));
+                emitStore(jit, d->dr, i + 1, length, next);
+                break;
+            case D_STI:
+                emitLoadConst(jit, vm, (uint16_t) (next + d->imm));
+                emitBytes(jit, (const uint8_t[]) {0x89, 0xC6}, 2); // mov esi, eax
+                emitStore(jit, d->dr, i + 1, length, next);
+                break;
+            case D_STR:
+                emitBasePlusOffset(jit, d->sr1, d->imm);
+                emitBytes(jit, (const uint8_t[]) {0x89, 0xC6}, 2); // mov esi, eax
+                emitStore(jit, d->dr, i + 1, length, next);
+                break;
+            case D_BR:
+                if (d->dr == 0) {
+                    emitExit(jit, next);
+                } else if (d->dr == 0x7) {
+                    emitExit(jit, (uint16_t) (next + d->imm));
+                } else {
+                    // cmp word [rbx + R_COND], 0 ; jcc taken
+                    emitBytes(jit, (const uint8_t[]) {0x66, 0x83, 0x7B, REG_DISP(R_COND), 0x00}, 5);
+                    emitBytes(jit, (const uint8_t[]) {0x0F, branchCondition[d->dr]}, 2);
+                    emit32(jit, 0);
+                    uint8_t *taken = jit->cursor - 4;
+                    emitExit(jit, next);
+                    patchRel32(taken, jit->cursor);
+                    emitExit(jit, (uint16_t) (next + d->imm));
+                }
+                break;
+            case D_JMP:
+                emitLoadRegEax(jit, d->sr1);
+                emitIndirectExit(jit);
+                break;
+            case D_JSR:
+                emitStoreRegImm(jit, R_R7, next);
+                emitExit(jit, (uint16_t) (next + d->imm));
+                break;
+            case D_JSRR:
+                emitLoadRegEax(jit, d->sr1);
+                emitStoreRegImm(jit, R_R7, next);
+                emitIndirectExit(jit);
+                break;
+            default:
+                // RTI and the reserved opcode do nothing, like in the interpreter
+                break;
+        }
+        if (setsFlags(d->handler)) {
+            emitStoreRegAx(jit, d->dr);
+            if (needFlags[i]) {
+                emitStoreRegAx(jit, R_COND);
+            }
+        }
+    }
+    if (!terminated) {
+        emitExit(jit, (uint16_t) pc);
+    }
+
+    jit->blockAt[start] = block->code;
+    jit->blockIndex[start] = index + 1;
+    memset(jit->codeMap + start, 1, pc - start);
+    return index;
+}
+
+void jitInit(struct lc3_vm *vm) {
+    if (vm->jit) {
+        return;
+    }
+    struct lc3_jit *jit = calloc(1, sizeof(struct lc3_jit));
+    if (!jit) {
+        printf("Unable to allocate JIT state");
+        exit(-1);
+    }
+    jit->codeBuffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+    if (jit->codeBuffer == MAP_FAILED) {
+        printf("Unable to allocate JIT code buffer");
+        exit(-1);
+    }
+    jit->cursor = jit->codeBuffer;
+
+    // prologue(registers, pages, blockAt, counter, code, vm)
+    jit->prologue = jit->cursor;
+    emitBytes(jit, (const uint8_t[]) {
+            0x53,             // push rbx
+            0x41, 0x54,       // push r12
+            0x41, 0x55,       // push r13
+            0x41, 0x56,       // push r14
+            0x41, 0x57,       // push r15, leaves rsp 16-byte aligned for helper calls
+            0x48, 0x89, 0xFB, // mov rbx, rdi
+            0x49, 0x89, 0xF4, // mov r12, rsi
+            0x49, 0x89, 0xD5, // mov r13, rdx
+            0x49, 0x89, 0xCE, // mov r14, rcx
+            0x4D, 0x89, 0xCF, // mov r15, r9
+            0x41, 0xFF, 0xE0, // jmp r8
+    }, 27);
+
+    // every block leaves through here with the exit stub to chain (or NULL) in rax
+    jit->epilogue = jit->cursor;
+    emitBytes(jit, (const uint8_t[]) {
+            0x41, 0x5F, // pop r15
+            0x41, 0x5E, // pop r14
+            0x41, 0x5D, // pop r13
+            0x41, 0x5C, // pop r12
+            0x5B,       // pop rbx
+            0xC3,       // ret
+    }, 10);
+
+    jit->translatedStart = jit->cursor;
+    vm->jit = jit;
+    flush(jit);
+}
+
+void jitDestroy(struct lc3_vm *vm) {
+    if (!vm->jit) {
+        return;
+    }
+    munmap(vm->jit->codeBuffer, JIT_CODE_SIZE);
+    free(vm->jit);
+    vm->jit = NULL;
+}
+
+void *jitBlock(struct lc3_vm *vm, uint16_t pc, uint8_t *exitSite) {
+    struct lc3_jit *jit = vm->jit;
+    if (jit->blockIndex[pc] == JIT_REFUSED) {
+        return NULL;
+    }
+    int index = jit->blockIndex[pc] - 1;
+    if (index < 0) {
+        if (jit->cursor + JIT_MAX_BLOCK_CODE > jit->codeBuffer + JIT_CODE_SIZE || jit->blockCount == JIT_MAX_BLOCKS) {
+            flush(jit);
+            exitSite = NULL;
+        }
+        index = translate(vm, pc);
+        if (index < 0) {
+            return NULL;
+        }
+    }
+    if (exitSite) {
+        chain(jit, exitSite, index);
+    }
+    return jit->blocks[index].code;
+}
+
+uint8_t *jitEnter(struct lc3_vm *vm, void *code, uint64_t counter[2]) {
+    typedef uint8_t *(*entry_fn)(uint16_t *, uint16_t **, void **, uint64_t *, void *, struct lc3_vm *);
+    return ((entry_fn) vm->jit->prologue)(vm->registers, vm->pages, vm->jit->blockAt, counter, code, vm);
+}
+
+void jitInvalidate(struct lc3_vm *vm, uint16_t address) {
+    struct lc3_jit *jit = vm->jit;
+    for (int i = 0; i < jit->blockCount; ++i) {
+        struct jit_block *block = &jit->blocks[i];
+        if (!block->live || address < block->start || address >= block->end) {
+            continue;
+        }
+        block->live = 0;
+        jit->blockAt[block->start] = NULL;
+        jit->blockIndex[block->start] = 0;
+        for (int l = block->links; l >= 0; l = jit->links[l].next) {
+            patchRel32(jit->links[l].site + 1, jit->epilogue);
+        }
+        memset(jit->codeMap + block->start, 0, block->end - block->start);
+        jit->invalidated = 1;
+    }
+    for (int i = 0; i < jit->refusalCount;) {
+        struct jit_refusal *refusal = &jit->refusals[i];
+        if (refusal->first <= address && address < refusal->end) {
+            jit->blockIndex[refusal->start] = 0;
+            memset(jit->codeMap + refusal->first, 0, refusal->end - refusal->first);
+            *refusal = jit->refusals[--jit->refusalCount];
+        } else {
+            ++i;
+        }
+    }
+    // overlapping blocks and refusals that survived still cover part of the cleared ranges
+    for (int i = 0; i < jit->blockCount; ++i) {
+        if (jit->blocks[i].live) {
+            memset(jit->codeMap + jit->blocks[i].start, 1, jit->blocks[i].end - jit->blocks[i].start);
+        }
+    }
+    for (int i = 0; i < jit->refusalCount; ++i) {
+        memset(jit->codeMap + jit->refusals[i].first, 1, jit->refusals[i].end - jit->refusals[i].first);
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    Basic-block JIT from LC-3 to x86-64.
+
+    A block starts at any guest address and runs until the first BR, JMP, JSR or JSRR (inclusive), the first
+    TRAP (exclusive, traps are executed by the interpreter) or the first page with a device. Guest registers
+    stay in `registers[]` for the whole block, so trap handlers and the interpreter always see up to date values.
+    Exits to a known address are patched into direct jumps once the target block exists.
+*/
+
+#define JIT_MAX_BLOCKS 8192
+#define JIT_MAX_BLOCK_LENGTH 64
+#define JIT_MAX_LINKS 16384
+#define JIT_MAX_REFUSALS 1024
+
+// blockIndex[] of an address translate() turned down, it is interpreted without asking again
+#define JIT_REFUSED (-1)
+
+struct jit_block {
+    uint16_t start;
+    uint32_t end;
+    uint8_t *code;
+    int links; // head of the incoming link list, -1 if empty
+    int live;
+};
+
+// an exit stub of some block that was patched to jump straight into another block
+struct jit_link {
+    uint8_t *site;
+    int next;
+};
+
+// an address that is interpreted until a store hits [first, end), the words the refusal was based on
+struct jit_refusal {
+    uint16_t start;
+    uint16_t first;
+    uint32_t end;
+};
+
+// translation state of one guest
+struct lc3_jit {
+    // guest words covered by at least one translated block or refusal, memoryWrite() hands writes to them to
+    // jitInvalidate()
+    uint8_t codeMap[0x10000];
+    void *blockAt[0x10000];         // native entry per guest address, read by translated code
+    int32_t blockIndex[0x10000];    // index + 1 into blocks[], 0 if there is no block, or JIT_REFUSED
+    struct jit_block blocks[JIT_MAX_BLOCKS];
+    int blockCount;
+    struct jit_link links[JIT_MAX_LINKS];
+    int linkCount;
+    struct jit_refusal refusals[JIT_MAX_REFUSALS];
+    int refusalCount;
+
+    uint8_t *codeBuffer;
+    uint8_t *cursor;
+    uint8_t *prologue;
+    uint8_t *epilogue;
+    uint8_t *translatedStart; // first byte after the prologue and the epilogue
+    int invalidated;
+};
+
+// allocates vm->jit on first use
+void jitInit(struct lc3_vm *vm);
+
+void jitDestroy(struct lc3_vm *vm);
+
+// returns the native entry of the block at `pc`, translating it if needed, or NULL if it has to be interpreted.
+// `exitSite` is the exit stub the previous block left through, it gets chained to the returned block.
+void *jitBlock(struct lc3_vm *vm, uint16_t pc, uint8_t *exitSite);
+
+// runs translated code until it leaves to the dispatcher. counter[0] counts retired instructions, a
+// block is not entered if its instructions would take counter[0] past counter[1]. Returns the exit stub to
+// chain, NULL for unchainable exits.
+uint8_t *jitEnter(struct lc3_vm *vm, void *code, uint64_t counter[2]);
+
+// drops every block and refusal that covers `address`
+void jitInvalidate(struct lc3_vm *vm, uint16_t address);
@@ -0,0 +1,171 @@
+#include "keyboard.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+void keyboardInit(struct lc3_keyboard *kb, int fd) {
+    kb->fd = fd;
+    atomic_init(&kb->head, 0);
+    atomic_init(&kb->tail, 0);
+    atomic_init(&kb->eof, 0);
+    kb->threaded = 0;
+}
+
+// producer side: reads what fits into the free part of the ring, returns 0 once input has ended. A nonblocking
+// fd without data is not the end, callers poll it again.
+static int fill(struct lc3_keyboard *kb) {
+    uint32_t tail = atomic_load_explicit(&kb->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&kb->head, memory_order_acquire);
+    uint32_t space = KEYBOARD_RING_SIZE - (tail - head);
+    if (space == 0) {
+        return 1;
+    }
+    uint32_t offset = tail & (KEYBOARD_RING_SIZE - 1);
+    uint32_t chunk = KEYBOARD_RING_SIZE - offset < space ? KEYBOARD_RING_SIZE - offset : space;
+    ssize_t n = read(kb->fd, kb->ring + offset, chunk);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    }
+    if (n <= 0) {
+        atomic_store_explicit(&kb->eof, 1, memory_order_release);
+        return 0;
+    }
+    atomic_store_explicit(&kb->tail, tail + (uint32_t) n, memory_order_release);
+    return 1;
+}
+
+static void *inputThread(void *arg) {
+    struct lc3_keyboard *kb = arg;
+    int more = 1;
+    while (more) {
+        uint32_t used = atomic_load_explicit(&kb->tail, memory_order_relaxed) -
+                        atomic_load_explicit(&kb->head, memory_order_acquire);
+        int full = used == KEYBOARD_RING_SIZE;
+        // with a full ring there is nothing to read into, check back for free space every millisecond
+        struct pollfd fds[2] = {{kb->stop[0], POLLIN, 0}, {kb->fd, POLLIN, 0}};
+        if (poll(fds, full ? 1 : 2, full ? 1 : -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[0].revents) {
+            return NULL;
+        }
+        if (full || !fds[1].revents) {
+            continue;
+        }
+        more = fill(kb);
+
+        pthread_mutex_lock(&kb->waitLock);
+        pthread_cond_broadcast(&kb->available);
+        pthread_mutex_unlock(&kb->waitLock);
+    }
+    return NULL;
+}
+
+void keyboardStartThread(struct lc3_keyboard *kb) {
+    if (pipe(kb->stop) != 0) {
+        printf("Failed to start the keyboard thread\n");
+        exit(-1);
+    }
+    pthread_mutex_init(&kb->waitLock, NULL);
+    // keyboardWait() deadlines are monotonic
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&kb->available, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&kb->thread, NULL, inputThread, kb) != 0) {
+        printf("Failed to start the keyboard thread\n");
+        exit(-1);
+    }
+    kb->threaded = 1;
+}
+
+void keyboardStop(struct lc3_keyboard *kb) {
+    if (!kb->threaded) {
+        return;
+    }
+    char c = 0;
+    if (write(kb->stop[1], &c, 1) != 1) {
+        // the thread has already exited at end of input
+    }
+    pthread_join(kb->thread, NULL);
+    close(kb->stop[0]);
+    close(kb->stop[1]);
+    pthread_mutex_destroy(&kb->waitLock);
+    pthread_cond_destroy(&kb->available);
+    kb->threaded = 0;
+}
+
+int keyboardReady(struct lc3_keyboard *kb) {
+    if (keyboardPending(kb)) {
+        return 1;
+    }
+    if (kb->threaded) {
+        return 0;
+    }
+    // pull the input in right away, so a ready keyboard always has its byte (or end of input) pending
+    struct pollfd pfd = {kb->fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) > 0) {
+        fill(kb);
+    }
+    return keyboardPending(kb);
+}
+
+void keyboardWait(struct lc3_keyboard *kb, uint64_t deadline) {
+    struct timespec until = {(time_t) (deadline / 1000000000), (long) (deadline % 1000000000)};
+    if (kb->threaded) {
+        pthread_mutex_lock(&kb->waitLock);
+        while (!keyboardPending(kb)) {
+            if (!deadline) {
+                pthread_cond_wait(&kb->available, &kb->waitLock);
+            } else if (pthread_cond_timedwait(&kb->available, &kb->waitLock, &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&kb->waitLock);
+        return;
+    }
+    while (!keyboardPending(kb)) {
+        int timeout = -1;
+        if (deadline) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t now = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+            if (now >= deadline) {
+                return;
+            }
+            // rounded up, so the wait does not end just short of the deadline
+            timeout = (int) ((deadline - now + 999999) / 1000000);
+        }
+        struct pollfd pfd = {kb->fd, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) > 0) {
+            fill(kb);
+        }
+    }
+}
+
+uint16_t keyboardRead(struct lc3_keyboard *kb) {
+    if (!keyboardPending(kb)) {
+        if (kb->threaded) {
+            pthread_mutex_lock(&kb->waitLock);
+            while (!keyboardPending(kb)) {
+                pthread_cond_wait(&kb->available, &kb->waitLock);
+            }
+            pthread_mutex_unlock(&kb->waitLock);
+        } else {
+            struct pollfd pfd = {kb->fd, POLLIN, 0};
+            while (!keyboardPending(kb) && (poll(&pfd, 1, -1) >= 0 || errno == EINTR) && fill(kb)) {
+            }
+        }
+    }
+    uint32_t head = atomic_load_explicit(&kb->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&kb->tail, memory_order_acquire)) {
+        return 0xFFFF;
+    }
+    uint8_t c = kb->ring[head & (KEYBOARD_RING_SIZE - 1)];
+    atomic_store_explicit(&kb->head, head + 1, memory_order_release);
+    return c;
+}
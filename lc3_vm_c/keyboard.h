@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+    Keyboard device behind KBSR/KBDR.
+
+    Input bytes go through a single-producer single-consumer ring buffer. With an input thread
+    (keyboardStartThread()) the thread is the producer and blocks in read() on the input fd, so the guest
+    side of KBSR/KBDR is a pair of loads and never enters the kernel. Without a thread the guest refills the
+    ring itself, which is what the scheduler uses for its parked guests. Bytes leave the ring in the order
+    they were read in both cases.
+*/
+
+#define KEYBOARD_RING_SIZE 4096 // power of two
+
+struct lc3_keyboard {
+    int fd;
+    // head is only written by the consumer, tail only by the producer, both count up without wrapping
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic int eof; // the producer hit end of input, set after the last byte was published
+    uint8_t ring[KEYBOARD_RING_SIZE];
+
+    int threaded;
+    pthread_t thread;
+    int stop[2];               // self-pipe that wakes the input thread up for shutdown
+    pthread_mutex_t waitLock;  // only taken by a consumer blocking on an empty ring and the producer waking it
+    pthread_cond_t available;
+};
+
+void keyboardInit(struct lc3_keyboard *kb, int fd);
+
+// moves reading `fd` to a dedicated thread
+void keyboardStartThread(struct lc3_keyboard *kb);
+
+// stops the input thread, if any
+void keyboardStop(struct lc3_keyboard *kb);
+
+// 1 if a byte or end of input is pending, keyboardPending() holds afterwards
+int keyboardReady(struct lc3_keyboard *kb);
+
+// waits until keyboardPending() holds or the monotonic `deadline` in ns has passed, 0 for no deadline
+void keyboardWait(struct lc3_keyboard *kb, uint64_t deadline);
+
+// next input byte, waits for it if needed, 0xFFFF at end of input
+uint16_t keyboardRead(struct lc3_keyboard *kb);
+
+// fast path of keyboardReady(), no syscalls
+static inline int keyboardPending(struct lc3_keyboard *kb) {
+    return atomic_load_explicit(&kb->head, memory_order_relaxed) !=
+           atomic_load_explicit(&kb->tail, memory_order_acquire) ||
+           atomic_load_explicit(&kb->eof, memory_order_acquire);
+}
+
+// the byte keyboardRead() returns next without consuming it, 0xFFFF at end of input. Only valid while
+// keyboardPending() is true.
+static inline uint16_t keyboardPeek(struct lc3_keyboard *kb) {
+    uint32_t head = atomic_load_explicit(&kb->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&kb->tail, memory_order_acquire)) {
+        return 0xFFFF;
+    }
+    return kb->ring[head & (KEYBOARD_RING_SIZE - 1)];
+}
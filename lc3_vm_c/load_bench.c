@@ -0,0 +1,39 @@
+#include "vm.h"
+
+// load_bench [-n <loads>] <image>... : average time readImageFile() takes per image
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int loads = 10000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            loads = atoi(optarg);
+        } else {
+            printf("Usage: ./load_bench [-n <loads>] <image>...\n");
+            exit(1);
+        }
+    }
+    if (optind >= argc || loads < 1) {
+        printf("Usage: ./load_bench [-n <loads>] <image>...\n");
+        exit(1);
+    }
+
+    struct lc3_vm *vm = createVm();
+    for (int i = optind; i < argc; ++i) {
+        // warm the page cache and the guest memory
+        readImageFile(vm, argv[i]);
+        double start = now();
+        for (int n = 0; n < loads; ++n) {
+            readImageFile(vm, argv[i]);
+        }
+        double elapsed = now() - start;
+        printf("%-40s %8.2f us/load\n", argv[i], elapsed / loads * 1e6);
+    }
+    destroyVm(vm);
+}
@@ -0,0 +1,182 @@
+#include "loader.h"
+#include "image.h"
+#include "vm.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOADER_READ_LIMIT 16384
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOADER_X86
+#endif
+
+static void swapWordsScalar(uint16_t *dst, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = (uint16_t) (src[2 * i] << 8 | src[2 * i + 1]);
+    }
+}
+
+#ifdef LOADER_X86
+
+// pshufb control that exchanges the two bytes of every word
+#define SWAP_CONTROL 14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1
+
+__attribute__((target("avx2")))
+static void swapWordsAvx2(uint16_t *dst, const uint8_t *src, size_t count) {
+    const __m256i control = _mm256_set_epi8(SWAP_CONTROL, SWAP_CONTROL);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (src + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (src + 2 * i + 32));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(a, control));
+        _mm256_storeu_si256((__m256i *) (dst + i + 16), _mm256_shuffle_epi8(b, control));
+    }
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (src + 2 * i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(a, control));
+    }
+    swapWordsScalar(dst + i, src + 2 * i, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void swapWordsSsse3(uint16_t *dst, const uint8_t *src, size_t count) {
+    const __m128i control = _mm_set_epi8(SWAP_CONTROL);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(a, control));
+    }
+    swapWordsScalar(dst + i, src + 2 * i, count - i);
+}
+
+#endif
+
+void swapWords(uint16_t *dst, const uint8_t *src, size_t count) {
+#ifdef LOADER_X86
+    if (__builtin_cpu_supports("avx2")) {
+        swapWordsAvx2(dst, src, count);
+        return;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        swapWordsSsse3(dst, src, count);
+        return;
+    }
+#endif
+    swapWordsScalar(dst, src, count);
+}
+
+static int isContainer(const uint8_t *image, size_t size) {
+    return size >= sizeof(struct yavm_image_header) && memcmp(image, YAVM_IMAGE_MAGIC, 4) == 0;
+}
+
+// guest memory ends at 0xFFFF, words past it are dropped
+static uint32_t clampCount(uint16_t origin, uint32_t count) {
+    uint32_t maxRead = 0x10000u - origin;
+    return count > maxRead ? maxRead : count;
+}
+
+static void loadObj(struct lc3_vm *vm, uint16_t *memory, const uint8_t *image, size_t size) {
+    uint16_t origin = (uint16_t) (image[0] << 8 | image[1]);
+    uint32_t count = clampCount(origin, (uint32_t) ((size - 2) / 2));
+    swapWords(memory + origin, image + 2, count);
+    invalidateDecoded(vm, origin, count);
+}
+
+static void loadContainer(struct lc3_vm *vm, uint16_t *memory, const uint8_t *image, size_t size,
+                          const char *path) {
+    struct yavm_image_header header;
+    memcpy(&header, image, sizeof(header));
+    if (header.version != YAVM_IMAGE_VERSION || header.byteOrder != YAVM_IMAGE_BYTE_ORDER) {
+        printf("Image %s has version %u and byte order 0x%04x, expected %u and 0x%04x\n", path,
+               header.version, header.byteOrder, YAVM_IMAGE_VERSION, YAVM_IMAGE_BYTE_ORDER);
+        exit(-1);
+    }
+    if (header.segmentCount > (size - sizeof(header)) / sizeof(struct yavm_image_segment)) {
+        printf("Image %s has a truncated segment table\n", path);
+        exit(-1);
+    }
+    for (uint32_t i = 0; i < header.segmentCount; ++i) {
+        struct yavm_image_segment segment;
+        memcpy(&segment, image + sizeof(header) + i * sizeof(segment), sizeof(segment));
+        if (segment.offset > size || segment.count > (size - segment.offset) / 2) {
+            printf("Segment %u of %s lies outside the file\n", i, path);
+            exit(-1);
+        }
+        uint32_t count = clampCount(segment.origin, segment.count);
+        memcpy(memory + segment.origin, image + segment.offset, count * sizeof(uint16_t));
+        invalidateDecoded(vm, segment.origin, count);
+    }
+}
+
+// loads into a staged image, the guest only changes the predecode cache
+static void loadStaged(struct lc3_vm *vm, struct lc3_image *staged, const uint8_t *image, size_t size,
+                       const char *name) {
+    if (size < 2) {
+        printf("Image %s has no origin\n", name);
+        exit(-1);
+    }
+    if (isContainer(image, size)) {
+        loadContainer(vm, staged->words, image, size, name);
+    } else {
+        loadObj(vm, staged->words, image, size);
+    }
+}
+
+void loadImage(struct lc3_vm *vm, const uint8_t *image, size_t size, const char *name) {
+    struct lc3_image *staged = stageImage(vm);
+    loadStaged(vm, staged, image, size, name);
+    commitImage(vm, staged);
+}
+
+static void readStaged(struct lc3_vm *vm, struct lc3_image *staged, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Wrong path");
+        exit(-1);
+    }
+    // below a few pages one read() is cheaper than setting up and tearing down a mapping
+    uint8_t small[LOADER_READ_LIMIT];
+    const uint8_t *image = small;
+    if (st.st_size <= LOADER_READ_LIMIT) {
+        if (read(fd, small, st.st_size) != st.st_size) {
+            printf("Failed to read %s\n", path);
+            exit(-1);
+        }
+    } else {
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (image == MAP_FAILED) {
+            printf("Failed to map %s\n", path);
+            exit(-1);
+        }
+    }
+    close(fd);
+
+    loadStaged(vm, staged, image, st.st_size, path);
+    if (image != small) {
+        munmap((void *) image, st.st_size);
+    }
+}
+
+void readImageFile(struct lc3_vm *vm, const char *path) {
+    struct lc3_image *staged = stageImage(vm);
+    readStaged(vm, staged, path);
+    commitImage(vm, staged);
+}
+
+void readImageFiles(struct lc3_vm *vm, const char *paths) {
+    // all of them go into one staged image, so guests loading the same list end up sharing it
+    struct lc3_image *staged = stageImage(vm);
+    char *list = strdup(paths);
+    char *rest = list;
+    char *path;
+    while ((path = strsep(&rest, ","))) {
+        if (*path) {
+            readStaged(vm, staged, path);
+        }
+    }
+    free(list);
+    commitImage(vm, staged);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Image loading. An .obj image is a big-endian origin followed by big-endian words; readImageFile() maps the
+    file and byte-swaps it into a staged copy of guest memory, see stageImage(). Files that start with
+    YAVM_IMAGE_MAGIC are .yvm containers (see image.h) and are copied segment by segment without swapping.
+    readImageFiles() loads a comma separated list of images into the same guest, later images overwriting
+    earlier ones where they overlap. Guests that end up with the same words share one read-only copy of them.
+*/
+
+// dst[i] = byte-swapped src[i], src may be unaligned. Uses AVX2 or SSSE3 when the CPU has them.
+void swapWords(uint16_t *dst, const uint8_t *src, size_t count);
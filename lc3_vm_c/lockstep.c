@@ -0,0 +1,136 @@
+#include "lockstep_lanes.h"
+
+struct lc3_lockstep *lockstepCreate(void) {
+    struct lc3_lockstep *ls = aligned_alloc(32, sizeof(struct lc3_lockstep));
+    if (!ls) {
+        printf("Unable to allocate lockstep lanes");
+        exit(-1);
+    }
+    memset(ls, 0, sizeof(struct lc3_lockstep));
+    for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+        ls->lanes[l].outputFd = -1;
+    }
+    return ls;
+}
+
+static void flushLane(struct lockstep_lane *lane) {
+    int written = 0;
+    while (lane->outputFd >= 0 && written < lane->outputSize) {
+        ssize_t n = write(lane->outputFd, lane->outputBuffer + written, lane->outputSize - written);
+        if (n <= 0) {
+            break;
+        }
+        written += (int) n;
+    }
+    lane->outputSize = 0;
+}
+
+void lockstepDestroy(struct lc3_lockstep *ls) {
+    for (int l = 0; l < LOCKSTEP_LANES; ++l) {
+        flushLane(&ls->lanes[l]);
+    }
+    free(ls);
+}
+
+void lockstepLoadImage(struct lc3_lockstep *ls, const char *paths) {
+    struct lc3_vm *vm = createVm();
+    readImageFiles(vm, paths);
+    memorySnapshot(vm, ls->image);
+    destroyVm(vm);
+}
+
+void lockstepStartLane(struct lc3_lockstep *ls, int lane, const uint8_t *input, size_t size, int outputFd) {
+    for (uint32_t address = 0; address < 0x10000; ++address) {
+        ls->memory[address][lane] = ls->image[address];
+    }
+    for (int r = 0; r < R_COUNT; ++r) {
+        ls->registers[r][lane] = 0;
+    }
+    ls->registers[R_PC][lane] = 0x3000;
+    ls->registers[R_COND][lane] = conditionResult(FL_ZR);
+
+    struct lockstep_lane *l = &ls->lanes[lane];
+    flushLane(l);
+    l->status = VM_BUDGET;
+    l->instructions = 0;
+    l->input = input;
+    l->inputSize = size;
+    l->inputPosition = 0;
+    l->outputFd = outputFd;
+    ls->active |= 1u << lane;
+}
+
+void lockstepStopLane(struct lc3_lockstep *ls, int lane, int status) {
+    ls->lanes[lane].status = status;
+    ls->active &= ~(1u << lane);
+    flushLane(&ls->lanes[lane]);
+}
+
+static void outputChar(struct lockstep_lane *lane, char c) {
+    if (lane->outputSize == OUTPUT_BUFFER_SIZE) {
+        flushLane(lane);
+    }
+    lane->outputBuffer[lane->outputSize++] = c;
+}
+
+static void outputString(struct lockstep_lane *lane, const char *str) {
+    while (*str) {
+        outputChar(lane, *str++);
+    }
+}
+
+void lockstepTrap(struct lc3_lockstep *ls, int lane, uint16_t vector) {
+    struct lockstep_lane *l = &ls->lanes[lane];
+    uint16_t *r0 = &ls->registers[R_R0][lane];
+    if (l->outputFd < 0 && (vector == TRAP_OUT || vector == TRAP_PUTS || vector == TRAP_PUTSP)) {
+        return;
+    }
+    switch (vector) {
+        case TRAP_GETC:
+            *r0 = readKey(l);
+            break;
+        case TRAP_IN: {
+            outputString(l, "Type in a character");
+            char c = (char) readKey(l);
+            outputChar(l, c);
+            *r0 = (uint16_t) c;
+            break;
+        }
+        case TRAP_OUT:
+            outputChar(l, (char) *r0);
+            break;
+        case TRAP_PUTS:
+            for (uint32_t address = *r0; address < 0x10000 && ls->memory[address][lane]; ++address) {
+                outputChar(l, (char) ls->memory[address][lane]);
+            }
+            break;
+        case TRAP_PUTSP:
+            for (uint32_t address = *r0; address < 0x10000 && ls->memory[address][lane]; ++address) {
+                uint16_t word = ls->memory[address][lane];
+                outputChar(l, (char) (word & 0xFF));
+                if (word >> 8) {
+                    outputChar(l, (char) (word >> 8));
+                }
+            }
+            break;
+        case TRAP_HALT:
+            outputString(l, "Halting...\n");
+            lockstepStopLane(ls, lane, VM_HALTED);
+            break;
+    }
+}
+
+uint64_t lockstepRun(struct lc3_lockstep *ls, uint64_t limit) {
+    ls->limit = limit;
+    FOR_BITS(ls->active, l) {
+        if (limit && ls->lanes[l].instructions >= limit) {
+            lockstepStopLane(ls, (int) l, VM_STOPPED);
+        }
+    }
+#ifdef LOCKSTEP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return lockstepKernelAvx2(ls);
+    }
+#endif
+    return lockstepKernel(ls);
+}
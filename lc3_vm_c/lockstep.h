@@ -0,0 +1,61 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    Lockstep execution of up to LOCKSTEP_LANES guests running the same image with different input, for
+    fuzzing and parameter sweeps.
+
+    Registers are kept structure-of-arrays, one 16-bit slot per lane, and memory is interleaved so that the same
+    address of every lane is one contiguous row. Each step runs one instruction for a group of lanes that sit at
+    the same PC with the same instruction word there, the others are masked off. The lanes at the lowest PC go
+    first and run until they get past the lowest PC of the waiting lanes or reach the PC of one of them, which
+    on structured code is where paths join again, and take it along from there. Register instructions and
+    loads/stores at a PC-relative address work on all lanes at once, with AVX2 on CPUs that have it and with
+    plain loops otherwise; LDR, LDI, STR, STI, traps and device registers are done lane by lane.
+
+    Traps and devices behave like in vm_c: a lane's input is its whole keyboard input, so KBSR always reads
+    as ready and GETC, IN and KBDR return 0xFFFF once it is used up.
+*/
+
+#define LOCKSTEP_LANES 16
+
+struct lockstep_lane {
+    int status; // VM_HALTED, VM_STOPPED at the instruction limit, VM_BUDGET while it has not finished
+    uint64_t instructions;
+
+    const uint8_t *input;
+    size_t inputSize;
+    size_t inputPosition;
+
+    int outputFd; // -1 to discard the output
+    int outputSize;
+    char outputBuffer[OUTPUT_BUFFER_SIZE];
+};
+
+struct lc3_lockstep {
+    // lane l of register r is registers[r][l]
+    _Alignas(32) uint16_t registers[R_COUNT][LOCKSTEP_LANES];
+    // word `address` of lane l is memory[address][l]
+    _Alignas(32) uint16_t memory[0x10000][LOCKSTEP_LANES];
+    uint16_t image[0x10000]; // what every lane starts with
+    uint32_t active;         // bit per lane that is still running
+    uint64_t limit;          // instructions per lane, 0 for none
+    uint64_t steps;          // instructions run for a group of lanes, each lane of it counts one
+    struct lockstep_lane lanes[LOCKSTEP_LANES];
+};
+
+struct lc3_lockstep *lockstepCreate(void);
+
+void lockstepDestroy(struct lc3_lockstep *ls);
+
+// loads a comma separated list of images into every lane, see readImageFiles()
+void lockstepLoadImage(struct lc3_lockstep *ls, const char *paths);
+
+// starts `lane` at 0x3000 with the loaded image. The input is not copied and has to stay around until the
+// lane finishes.
+void lockstepStartLane(struct lc3_lockstep *ls, int lane, const uint8_t *input, size_t size, int outputFd);
+
+// runs the started lanes until every one of them halted or ran `limit` instructions (0 for no limit),
+// returns the number of instructions of all lanes together
+uint64_t lockstepRun(struct lc3_lockstep *ls, uint64_t limit);
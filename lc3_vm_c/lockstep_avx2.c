@@ -0,0 +1,5 @@
+// the AVX2 build of the lane kernel, see lockstep_lanes.h
+#if defined(__x86_64__) || defined(__i386__)
+#define LOCKSTEP_AVX2
+#include "lockstep_lanes.h"
+#endif
@@ -0,0 +1,403 @@
+#pragma once
+
+#include "lockstep.h"
+#include <string.h>
+
+/*
+    The lane kernel behind lockstepRun(), built twice: with plain loops in lockstep.c and with AVX2 in
+    lockstep_avx2.c, which defines LOCKSTEP_AVX2. lockstepRun() only calls the AVX2 build on CPUs that
+    have it, the rest of the VM never runs AVX2 code.
+
+    lanes_t holds one 16-bit value per lane. Masks are lanes_t too, 0xFFFF in the lanes they select, and
+    bit masks have bit l set for lane l.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LOCKSTEP_X86
+#endif
+
+#ifdef LOCKSTEP_AVX2
+#define LOCKSTEP_KERNEL lockstepKernelAvx2
+#else
+#define LOCKSTEP_KERNEL lockstepKernel
+#endif
+
+// runs the started lanes of `ls` up to ls->limit, returns the instructions of all lanes together
+uint64_t lockstepKernel(struct lc3_lockstep *ls);
+
+uint64_t lockstepKernelAvx2(struct lc3_lockstep *ls);
+
+// in lockstep.c, shared by both builds
+void lockstepStopLane(struct lc3_lockstep *ls, int lane, int status);
+
+void lockstepTrap(struct lc3_lockstep *ls, int lane, uint16_t vector);
+
+#ifdef LOCKSTEP_AVX2
+#include <immintrin.h>
+
+#define LANES_TARGET __attribute__((target("avx2")))
+
+typedef __m256i lanes_t;
+
+LANES_TARGET
+static inline lanes_t lanesLoad(const uint16_t *p) {
+    return _mm256_load_si256((const __m256i *) p);
+}
+
+LANES_TARGET
+static inline void lanesStore(uint16_t *p, lanes_t a) {
+    _mm256_store_si256((__m256i *) p, a);
+}
+
+LANES_TARGET
+static inline lanes_t lanesSplat(uint16_t x) {
+    return _mm256_set1_epi16((short) x);
+}
+
+LANES_TARGET
+static inline lanes_t lanesAdd(lanes_t a, lanes_t b) {
+    return _mm256_add_epi16(a, b);
+}
+
+LANES_TARGET
+static inline lanes_t lanesAnd(lanes_t a, lanes_t b) {
+    return _mm256_and_si256(a, b);
+}
+
+LANES_TARGET
+static inline lanes_t lanesNot(lanes_t a) {
+    return _mm256_xor_si256(a, _mm256_set1_epi16(-1));
+}
+
+LANES_TARGET
+static inline lanes_t lanesEqual(lanes_t a, lanes_t b) {
+    return _mm256_cmpeq_epi16(a, b);
+}
+
+// 0xFFFF where the sign bit is set
+LANES_TARGET
+static inline lanes_t lanesNegative(lanes_t a) {
+    return _mm256_srai_epi16(a, 15);
+}
+
+// mask ? a : b
+LANES_TARGET
+static inline lanes_t lanesSelect(lanes_t mask, lanes_t a, lanes_t b) {
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+LANES_TARGET
+static inline uint32_t lanesBits(lanes_t mask) {
+    // signed saturation keeps 0xFFFF and 0 apart, one byte per lane in lane order
+    __m128i packed = _mm_packs_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+    return (uint32_t) _mm_movemask_epi8(packed);
+}
+
+LANES_TARGET
+static inline lanes_t lanesFromBits(uint32_t bits) {
+    const lanes_t laneBit = _mm256_setr_epi16(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+                                              1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14,
+                                              (short) (1 << 15));
+    return lanesEqual(lanesAnd(lanesSplat((uint16_t) bits), laneBit), laneBit);
+}
+
+LANES_TARGET
+static inline uint16_t lanesMin(lanes_t a) {
+    __m128i half = _mm_min_epu16(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+    return (uint16_t) _mm_cvtsi128_si32(_mm_minpos_epu16(half));
+}
+
+#else
+
+#define LANES_TARGET
+
+typedef struct {
+    uint16_t lane[LOCKSTEP_LANES];
+} lanes_t;
+
+#define FOR_LANES for (int l = 0; l < LOCKSTEP_LANES; ++l)
+
+static inline lanes_t lanesLoad(const uint16_t *p) {
+    lanes_t r;
+    memcpy(r.lane, p, sizeof(r.lane));
+    return r;
+}
+
+static inline void lanesStore(uint16_t *p, lanes_t a) {
+    memcpy(p, a.lane, sizeof(a.lane));
+}
+
+static inline lanes_t lanesSplat(uint16_t x) {
+    lanes_t r;
+    FOR_LANES r.lane[l] = x;
+    return r;
+}
+
+static inline lanes_t lanesAdd(lanes_t a, lanes_t b) {
+    FOR_LANES a.lane[l] += b.lane[l];
+    return a;
+}
+
+static inline lanes_t lanesAnd(lanes_t a, lanes_t b) {
+    FOR_LANES a.lane[l] &= b.lane[l];
+    return a;
+}
+
+static inline lanes_t lanesNot(lanes_t a) {
+    FOR_LANES a.lane[l] = ~a.lane[l];
+    return a;
+}
+
+static inline lanes_t lanesEqual(lanes_t a, lanes_t b) {
+    FOR_LANES a.lane[l] = a.lane[l] == b.lane[l] ? 0xFFFF : 0;
+    return a;
+}
+
+static inline lanes_t lanesNegative(lanes_t a) {
+    FOR_LANES a.lane[l] = a.lane[l] >> 15 ? 0xFFFF : 0;
+    return a;
+}
+
+static inline lanes_t lanesSelect(lanes_t mask, lanes_t a, lanes_t b) {
+    FOR_LANES a.lane[l] = (a.lane[l] & mask.lane[l]) | (b.lane[l] & ~mask.lane[l]);
+    return a;
+}
+
+static inline uint32_t lanesBits(lanes_t mask) {
+    uint32_t bits = 0;
+    FOR_LANES bits |= (uint32_t) (mask.lane[l] & 1) << l;
+    return bits;
+}
+
+static inline lanes_t lanesFromBits(uint32_t bits) {
+    lanes_t r;
+    FOR_LANES r.lane[l] = bits >> l & 1 ? 0xFFFF : 0;
+    return r;
+}
+
+static inline uint16_t lanesMin(lanes_t a) {
+    uint16_t min = a.lane[0];
+    FOR_LANES min = a.lane[l] < min ? a.lane[l] : min;
+    return min;
+}
+
+#endif
+
+// lane index `l` of every set bit, lowest first
+#define FOR_BITS(bits, l) \
+    for (uint32_t rest_ = (bits), l; rest_ && (l = (uint32_t) __builtin_ctz(rest_), 1); rest_ &= rest_ - 1)
+
+static inline uint16_t readKey(struct lockstep_lane *lane) {
+    return lane->inputPosition < lane->inputSize ? lane->input[lane->inputPosition++] : 0xFFFF;
+}
+
+// the input is all there from the start, so the keyboard is always ready, like vm_c at end of input
+static inline uint16_t laneRead(struct lc3_lockstep *ls, int lane, uint16_t address) {
+    if (address == MR_KBSR || address == MR_DSR) {
+        return STATUS_BIT;
+    } else if (address == MR_KBDR) {
+        return readKey(&ls->lanes[lane]);
+    } else if (address == MR_DDR) {
+        return 0;
+    }
+    return ls->memory[address][lane];
+}
+
+// R_COND keeps the result like in the VM, see conditionFlags()
+static inline void laneResult(struct lc3_lockstep *ls, int lane, uint8_t dr, uint16_t value) {
+    ls->registers[dr][lane] = value;
+    ls->registers[R_COND][lane] = value;
+}
+
+LANES_TARGET
+static inline lanes_t flags(lanes_t value) {
+    return lanesSelect(lanesEqual(value, lanesSplat(0)), lanesSplat(FL_ZR),
+                       lanesSelect(lanesNegative(value), lanesSplat(FL_NEG), lanesSplat(FL_POS)));
+}
+
+LANES_TARGET
+static inline void result(struct lc3_lockstep *ls, uint8_t dr, lanes_t mask, lanes_t value) {
+    lanesStore(ls->registers[dr], lanesSelect(mask, value, lanesLoad(ls->registers[dr])));
+    lanesStore(ls->registers[R_COND], lanesSelect(mask, value, lanesLoad(ls->registers[R_COND])));
+}
+
+// `target` if it is `first` in every lane of the group, otherwise the lanes' own PCs are set and -1 returned
+LANES_TARGET
+static inline int32_t jump(struct lc3_lockstep *ls, lanes_t mask, uint32_t bits, lanes_t target, uint16_t first) {
+    if (lanesBits(lanesAnd(mask, lanesEqual(target, lanesSplat(first)))) == bits) {
+        return first;
+    }
+    lanesStore(ls->registers[R_PC], lanesSelect(mask, target, lanesLoad(ls->registers[R_PC])));
+    return -1;
+}
+
+/*
+    Runs `d` at `pc` in the lanes of the group, `mask` and `bits` being the same lanes. Returns the PC all of
+    them go on at, or -1 after a branch split them up, in which case their PCs are already set.
+*/
+LANES_TARGET
+static inline int32_t execute(struct lc3_lockstep *ls, struct lc3_decoded d, lanes_t mask, uint32_t bits,
+                              uint16_t pc) {
+    uint16_t (*r)[LOCKSTEP_LANES] = ls->registers;
+    uint16_t next = (uint16_t) (pc + 1);
+    switch (d.handler) {
+        case D_ADD:
+            result(ls, d.dr, mask, lanesAdd(lanesLoad(r[d.sr1]), lanesLoad(r[d.sr2])));
+            break;
+        case D_ADD_IMM:
+            result(ls, d.dr, mask, lanesAdd(lanesLoad(r[d.sr1]), lanesSplat(d.imm)));
+            break;
+        case D_AND:
+            result(ls, d.dr, mask, lanesAnd(lanesLoad(r[d.sr1]), lanesLoad(r[d.sr2])));
+            break;
+        case D_AND_IMM:
+            result(ls, d.dr, mask, lanesAnd(lanesLoad(r[d.sr1]), lanesSplat(d.imm)));
+            break;
+        case D_NOT:
+            result(ls, d.dr, mask, lanesNot(lanesLoad(r[d.sr1])));
+            break;
+        case D_LEA:
+            result(ls, d.dr, mask, lanesSplat((uint16_t) (next + d.imm)));
+            break;
+        case D_BR: {
+            if (d.dr == (FL_NEG | FL_ZR | FL_POS)) {
+                return (uint16_t) (next + d.imm);
+            }
+            lanes_t taken = lanesAnd(mask, lanesNot(lanesEqual(lanesAnd(flags(lanesLoad(r[R_COND])), lanesSplat(d.dr)),
+                                                               lanesSplat(0))));
+            uint32_t takenBits = lanesBits(taken);
+            if (takenBits == bits) {
+                return (uint16_t) (next + d.imm);
+            } else if (takenBits) {
+                lanes_t target = lanesSelect(taken, lanesSplat((uint16_t) (next + d.imm)), lanesSplat(next));
+                lanesStore(r[R_PC], lanesSelect(mask, target, lanesLoad(r[R_PC])));
+                return -1;
+            }
+            break;
+        }
+        case D_JMP:
+            return jump(ls, mask, bits, lanesLoad(r[d.sr1]), r[d.sr1][__builtin_ctz(bits)]);
+        case D_JSR:
+            lanesStore(r[R_R7], lanesSelect(mask, lanesSplat(next), lanesLoad(r[R_R7])));
+            return (uint16_t) (next + d.imm);
+        case D_JSRR: {
+            // read BaseR before R7 is overwritten, JSRR R7 jumps to the old R7
+            lanes_t target = lanesLoad(r[d.sr1]);
+            uint16_t first = r[d.sr1][__builtin_ctz(bits)];
+            lanesStore(r[R_R7], lanesSelect(mask, lanesSplat(next), lanesLoad(r[R_R7])));
+            return jump(ls, mask, bits, target, first);
+        }
+        case D_LD: {
+            uint16_t address = (uint16_t) (next + d.imm);
+            if (address < MR_KBSR) {
+                result(ls, d.dr, mask, lanesLoad(ls->memory[address]));
+            } else {
+                FOR_BITS(bits, l) {
+                    laneResult(ls, (int) l, d.dr, laneRead(ls, (int) l, address));
+                }
+            }
+            break;
+        }
+        case D_ST: {
+            // device registers are plain memory for stores, like in memoryWrite()
+            uint16_t address = (uint16_t) (next + d.imm);
+            lanesStore(ls->memory[address], lanesSelect(mask, lanesLoad(r[d.dr]), lanesLoad(ls->memory[address])));
+            break;
+        }
+        case D_LDR:
+            FOR_BITS(bits, l) {
+                laneResult(ls, (int) l, d.dr, laneRead(ls, (int) l, (uint16_t) (r[d.sr1][l] + d.imm)));
+            }
+            break;
+        case D_LDI:
+            FOR_BITS(bits, l) {
+                uint16_t address = laneRead(ls, (int) l, (uint16_t) (next + d.imm));
+                laneResult(ls, (int) l, d.dr, laneRead(ls, (int) l, address));
+            }
+            break;
+        case D_STR:
+            FOR_BITS(bits, l) {
+                ls->memory[(uint16_t) (r[d.sr1][l] + d.imm)][l] = r[d.dr][l];
+            }
+            break;
+        case D_STI:
+            FOR_BITS(bits, l) {
+                ls->memory[laneRead(ls, (int) l, (uint16_t) (next + d.imm))][l] = r[d.dr][l];
+            }
+            break;
+        case D_TRAP:
+            FOR_BITS(bits, l) {
+                lockstepTrap(ls, (int) l, d.imm);
+            }
+            break;
+    }
+    return next;
+}
+
+// steps the lanes of `bits` can run together before the first of them reaches the limit
+static uint64_t runBound(struct lc3_lockstep *ls, uint32_t bits) {
+    uint64_t bound = UINT64_MAX;
+    if (ls->limit) {
+        FOR_BITS(bits, l) {
+            uint64_t left = ls->limit - ls->lanes[l].instructions;
+            bound = left < bound ? left : bound;
+        }
+    }
+    return bound;
+}
+
+LANES_TARGET
+uint64_t LOCKSTEP_KERNEL(struct lc3_lockstep *ls) {
+    uint64_t executed = 0;
+    uint16_t *pcs = ls->registers[R_PC];
+    while (ls->active) {
+        // the group: lanes at the lowest PC that have the same instruction there
+        lanes_t active = lanesFromBits(ls->active);
+        lanes_t lanePcs = lanesLoad(pcs);
+        uint16_t pc = lanesMin(lanesSelect(active, lanePcs, lanesSplat(0xFFFF)));
+        lanes_t atPc = lanesAnd(active, lanesEqual(lanePcs, lanesSplat(pc)));
+        int leader = __builtin_ctz(lanesBits(atPc));
+        lanes_t mask = lanesAnd(atPc, lanesEqual(lanesLoad(ls->memory[pc]), lanesSplat(ls->memory[pc][leader])));
+        uint32_t bits = lanesBits(mask);
+        lanes_t waiting = lanesAnd(active, lanesNot(mask));
+        uint32_t lowestWaiting = bits == ls->active ? 0x10000 : lanesMin(lanesSelect(waiting, lanePcs,
+                                                                                      lanesSplat(0xFFFF)));
+
+        // while the group stays together its PC is the same in every lane and only kept here
+        uint64_t bound = runBound(ls, bits);
+        uint64_t steps = 0;
+        int split = 0;
+        for (;;) {
+            uint16_t instruction = ls->memory[pc][leader];
+            // a lane that rewrote its code here goes on in a group of its own
+            lanes_t same = lanesEqual(lanesLoad(ls->memory[pc]), lanesSplat(instruction));
+            if (steps && lanesBits(lanesAnd(mask, same)) != bits) {
+                break;
+            }
+            int32_t next = execute(ls, decode(instruction), mask, bits, pc);
+            ++steps;
+            if (next < 0) {
+                split = 1;
+                break;
+            }
+            pc = (uint16_t) next;
+            if (pc > lowestWaiting || steps == bound || (ls->active & bits) != bits ||
+                lanesBits(lanesAnd(waiting, lanesEqual(lanePcs, lanesSplat(pc))))) {
+                break;
+            }
+        }
+        if (!split) {
+            lanesStore(pcs, lanesSelect(mask, lanesSplat(pc), lanesLoad(pcs)));
+        }
+
+        ls->steps += steps;
+        executed += steps * (uint64_t) __builtin_popcount(bits);
+        FOR_BITS(bits, l) {
+            ls->lanes[l].instructions += steps;
+            if (ls->limit && ls->lanes[l].instructions >= ls->limit && ls->lanes[l].status == VM_BUDGET) {
+                lockstepStopLane(ls, (int) l, VM_STOPPED);
+            }
+        }
+    }
+    return executed;
+}
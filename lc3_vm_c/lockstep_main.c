@@ -0,0 +1,100 @@
+#include "lockstep.h"
+#include <string.h>
+
+/*
+    yavm_lockstep [-s] [-o] [-n <instructions>] <image>[,<image>...] <input>...
+
+    Runs the image once per input file, LOCKSTEP_LANES of them at a time in lockstep, and prints how every
+    run ended with its instruction count. -o writes the output of each run to <input>.out, -n stops runs
+    after that many instructions and -s prints totals to stderr.
+*/
+
+static uint8_t *readInput(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Wrong path %s\n", path);
+        exit(-1);
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = malloc(length > 0 ? (size_t) length : 1);
+    if (!data || (length > 0 && fread(data, 1, (size_t) length, file) != (size_t) length)) {
+        printf("Failed to read %s\n", path);
+        exit(-1);
+    }
+    fclose(file);
+    *size = length > 0 ? (size_t) length : 0;
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    int stats = 0;
+    int writeOutput = 0;
+    uint64_t limit = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "son:")) != -1) {
+        switch (opt) {
+            case 's':
+                stats = 1;
+                break;
+            case 'o':
+                writeOutput = 1;
+                break;
+            case 'n':
+                limit = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (argc - optind < 2) {
+        printf("Usage: ./yavm_lockstep [-s] [-o] [-n <instructions>] <image>[,<image>...] <input>...\n");
+        exit(1);
+    }
+
+    struct lc3_lockstep *ls = lockstepCreate();
+    lockstepLoadImage(ls, argv[optind]);
+    char **inputs = argv + optind + 1;
+    int count = argc - optind - 1;
+
+    uint64_t total = 0;
+    uint64_t start = monotonicNs();
+    for (int first = 0; first < count; first += LOCKSTEP_LANES) {
+        int lanes = count - first < LOCKSTEP_LANES ? count - first : LOCKSTEP_LANES;
+        uint8_t *data[LOCKSTEP_LANES];
+        for (int l = 0; l < lanes; ++l) {
+            size_t size;
+            data[l] = readInput(inputs[first + l], &size);
+            int fd = -1;
+            if (writeOutput) {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s.out", inputs[first + l]);
+                fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    printf("Failed to create %s\n", path);
+                    exit(-1);
+                }
+            }
+            lockstepStartLane(ls, l, data[l], size, fd);
+        }
+        total += lockstepRun(ls, limit);
+        for (int l = 0; l < lanes; ++l) {
+            printf("%s %s %" PRIu64 "\n", inputs[first + l], ls->lanes[l].status == VM_HALTED ? "halted" : "stopped",
+                   ls->lanes[l].instructions);
+            if (ls->lanes[l].outputFd >= 0) {
+                close(ls->lanes[l].outputFd);
+                ls->lanes[l].outputFd = -1;
+            }
+            free(data[l]);
+        }
+    }
+    double seconds = (double) (monotonicNs() - start) / 1e9;
+    if (stats) {
+        fprintf(stderr, "%d runs, %" PRIu64 " instructions in %" PRIu64 " steps (%.2f lanes per step), "
+                        "%.3f s, %.1f M instructions/s\n", count, total, ls->steps,
+                ls->steps ? (double) total / (double) ls->steps : 0.0, seconds, (double) total / seconds / 1e6);
+    }
+    lockstepDestroy(ls);
+}
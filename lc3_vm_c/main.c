@@ -1,13 +1,258 @@
 #include "vm.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "replay.h"
+#include "debug.h"
 #include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef YAVM_JIT
+#include "jit.h"
+#endif
+
+// -j only exists in builds with the JIT
+#ifdef YAVM_JIT
+#define JIT_OPTION "j"
+#define JIT_USAGE "[-j] "
+#else
+#define JIT_OPTION ""
+#define JIT_USAGE ""
+#endif
+
+#define USAGE "Usage: ./<name_of_program> [-s] " JIT_USAGE "[-u] [-p <report>] [-r|-R <input log>] [-H] " \
+              "[-t <workers>] [-n <instructions>] [-T <seconds>] [-d] " \
+              "<path_to_bin>[,<path_to_bin>...][:<input>[:<output>]]...\n"
+
+// exit status when a guest hit its instruction cap or timeout, as timeout(1) does
+#define EXIT_LIMIT 124
+
+// instructions between output flushes while the debugger lets the guest continue
+#define DEBUG_SLICE (1u << 20)
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// opens a job's input or output, "-" is stdin/stdout
+static int openStream(const char *path, int output) {
+    if (strcmp(path, "-") == 0) {
+        return output ? STDOUT_FILENO : STDIN_FILENO;
+    }
+    int fd = output ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s\n", path);
+        exit(-1);
+    }
+    return fd;
+}
+
+// image[,image...][:input[:output]], output defaults to stdout
+static struct lc3_vm *createBatchVm(char *spec, const char *defaultInput) {
+    char *image = strtok(spec, ":");
+    char *input = strtok(NULL, ":");
+    char *output = strtok(NULL, ":");
+
+    struct lc3_vm *vm = createVm();
+    readImageFiles(vm, image);
+    vm->keyboard.fd = openStream(input ? input : defaultInput, 0);
+    vm->outputFd = openStream(output ? output : "-", 1);
+    vm->parkOnInput = 1;
+    return vm;
+}
+
+// -d: the prompt comes up before the first instruction and after every breakpoint, watchpoint or step
+static uint64_t debugGuest(struct lc3_vm *vm) {
+    startVm(vm);
+    int64_t run;
+    while ((run = debugPrompt(vm)) >= 0) {
+        int status;
+        if (run > 0) {
+            status = runVm(vm, (uint64_t) run);
+        } else {
+            while ((status = runVm(vm, DEBUG_SLICE)) == VM_BUDGET) {
+            }
+        }
+        if (status == VM_HALTED || status == VM_STOPPED) {
+            break;
+        }
+    }
+    return vm->instructionCount;
+}
+
+static void destroyBatchVm(struct lc3_vm *vm) {
+    int outputFd = vm->outputFd;
+    if (vm->keyboard.fd != STDIN_FILENO) {
+        close(vm->keyboard.fd);
+    }
+    destroyVm(vm);
+    if (outputFd != STDOUT_FILENO) {
+        close(outputFd);
+    }
+}
 
 //101
-int main(int argc, const char *argv[]) {
-    if (argc < 2){
-        printf("Usage: ./<name_of_program> <path_to_bin>");
+int main(int argc, char *argv[]) {
+    int stats = 0;
+#ifdef YAVM_JIT
+    int jit = 0;
+#endif
+    int workers = 0;
+    int unbuffered = 0;
+    FILE *profileReport = NULL;
+    const char *inputLog = NULL;
+    int inputLogMode = REPLAY_RECORD;
+    int headless = 0;
+    int debugging = 0;
+    uint64_t instructionLimit = 0;
+    uint64_t timeLimit = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s" JIT_OPTION "up:r:R:Ht:n:T:d")) != -1) {
+        switch (opt) {
+            case 's':
+                stats = 1;
+                break;
+#ifdef YAVM_JIT
+            case 'j':
+                jit = 1;
+                break;
+#endif
+            case 'u':
+                unbuffered = 1;
+                break;
+            case 'p':
+                profileReport = strcmp(optarg, "-") == 0 ? stderr : fopen(optarg, "w");
+                if (!profileReport) {
+                    printf("Failed to open %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'r':
+            case 'R':
+                inputLog = optarg;
+                inputLogMode = opt == 'r' ? REPLAY_RECORD : REPLAY_PLAY;
+                break;
+            case 'H':
+                headless = 1;
+                break;
+            case 't':
+                workers = atoi(optarg);
+                break;
+            case 'n':
+                instructionLimit = strtoull(optarg, NULL, 10);
+                break;
+            case 'T':
+                timeLimit = (uint64_t) (atof(optarg) * 1e9);
+                break;
+            case 'd':
+                debugging = 1;
+                break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (optind >= argc) {
+        printf(USAGE);
         exit(1);
     }
-    setup();
-    readImageFile(argv[1]);
-    emulate();
+
+    /*
+        Several images, an explicit worker count or -H run headless on the scheduler: no raw terminal, no
+        SIGINT handler, input and output are plain byte streams. A single job reads stdin unless it names an
+        input, several jobs default to /dev/null.
+    */
+    if (headless || workers > 0 || argc - optind > 1) {
+        if (inputLog || debugging) {
+            printf("Input record/replay and the debugger work with a single guest only\n");
+            exit(1);
+        }
+        int count = argc - optind;
+        struct scheduler *scheduler = createScheduler(workers > 0 ? workers : 1, SCHEDULER_DEFAULT_SLICE);
+        struct lc3_vm **vms = malloc(count * sizeof(struct lc3_vm *));
+        signal(SIGPIPE, SIG_IGN);
+        for (int i = 0; i < count; ++i) {
+            vms[i] = createBatchVm(argv[optind + i], count == 1 ? "-" : "/dev/null");
+            vms[i]->instructionLimit = instructionLimit;
+            vms[i]->timeLimit = timeLimit;
+            vms[i]->outputMode = unbuffered ? OUTPUT_UNBUFFERED : OUTPUT_BUFFERED;
+            if (profileReport) {
+                profileAttach(vms[i], profileReport);
+            }
+#ifdef YAVM_JIT
+            if (jit) {
+                jitInit(vms[i]);
+            }
+#endif
+            startVm(vms[i]);
+            schedulerAdd(scheduler, vms[i]);
+        }
+
+        double start = now();
+        schedulerRun(scheduler);
+        double elapsed = now() - start;
+
+        uint64_t executed = 0;
+        int limited = 0;
+        for (int i = 0; i < count; ++i) {
+            executed += vms[i]->instructionCount;
+            if (vms[i]->stopReason != STOP_NONE) {
+                fprintf(stderr, "%s: stopped after %" PRIu64 " instructions (%s)\n", argv[optind + i],
+                        vms[i]->instructionCount,
+                        vms[i]->stopReason == STOP_TIMEOUT ? "timeout" : "instruction limit");
+                limited = 1;
+            }
+            destroyBatchVm(vms[i]);
+        }
+        if (stats) {
+            fprintf(stderr, "%d guests, %" PRIu64 " instructions in %.3f s (%.1f M instructions/s)\n",
+                    count, executed, elapsed, elapsed > 0 ? (double) executed / elapsed / 1e6 : 0.0);
+        }
+        free(vms);
+        destroyScheduler(scheduler);
+        if (profileReport && profileReport != stderr) {
+            fclose(profileReport);
+        }
+        return limited ? EXIT_LIMIT : 0;
+    }
+
+    struct lc3_vm *vm = createVm();
+    setup(vm);
+    readImageFiles(vm, argv[optind]);
+    if (inputLog) {
+        replayAttach(vm, inputLog, inputLogMode);
+    }
+    // a replayed guest never touches stdin, the debugger reads its commands from there
+    if ((!inputLog || inputLogMode == REPLAY_RECORD) && !debugging) {
+        keyboardStartThread(&vm->keyboard);
+    }
+    vm->outputMode = unbuffered ? OUTPUT_UNBUFFERED : OUTPUT_BUFFERED;
+    vm->instructionLimit = instructionLimit;
+    vm->timeLimit = timeLimit;
+    if (profileReport) {
+        profileAttach(vm, profileReport);
+    }
+
+    double start = now();
+#ifdef YAVM_JIT
+    if (jit) {
+        jitInit(vm);
+    }
+#endif
+    uint64_t executed = debugging ? debugGuest(vm) : emulate(vm);
+    double elapsed = now() - start;
+
+    restoreInputBuffering(vm);
+    if (stats) {
+        fprintf(stderr, "%" PRIu64 " instructions in %.3f s (%.1f M instructions/s)\n",
+                executed, elapsed, elapsed > 0 ? (double) executed / elapsed / 1e6 : 0.0);
+    }
+    int limited = vm->stopReason != STOP_NONE;
+    destroyVm(vm);
+    if (profileReport && profileReport != stderr) {
+        fclose(profileReport);
+    }
+    return limited ? EXIT_LIMIT : 0;
 }
@@ -0,0 +1,160 @@
+#include "vm.h"
+#include <pthread.h>
+#include <string.h>
+
+// every page nothing was loaded into or written to, never written itself since stores copy it first
+static uint16_t zeroPage[PAGE_WORDS];
+
+// images in use, guests on different threads load and drop them
+static struct lc3_image *images;
+static pthread_mutex_t imagesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hashWords(const uint16_t *words) {
+    const uint64_t *chunks = (const uint64_t *) words;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < 0x10000 * sizeof(uint16_t) / sizeof(uint64_t); ++i) {
+        hash = (hash ^ chunks[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static int isZero(const uint16_t *page) {
+    for (uint32_t i = 0; i < PAGE_WORDS; ++i) {
+        if (page[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int sameWords(const struct lc3_image *image, const uint16_t *words) {
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        if (memcmp(image->pages[page], words + (page << PAGE_SHIFT), PAGE_WORDS * sizeof(uint16_t)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint16_t *allocatePage(void) {
+    uint16_t *page = malloc(PAGE_WORDS * sizeof(uint16_t));
+    if (!page) {
+        printf("Unable to allocate a memory page");
+        exit(-1);
+    }
+    return page;
+}
+
+static void freeImage(struct lc3_image *image) {
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        if (image->pages[page] != zeroPage) {
+            free(image->pages[page]);
+        }
+    }
+    free(image->words);
+    free(image);
+}
+
+static void dropPrivatePages(struct lc3_vm *vm) {
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        free(vm->privatePages[page]);
+        vm->privatePages[page] = NULL;
+    }
+}
+
+// `image` NULL maps the zero page everywhere
+static void mapImage(struct lc3_vm *vm, struct lc3_image *image) {
+    dropPrivatePages(vm);
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        vm->pages[page] = image ? image->pages[page] : zeroPage;
+    }
+    struct lc3_image *old = vm->image;
+    vm->image = image;
+    releaseImage(old);
+}
+
+void memoryInit(struct lc3_vm *vm) {
+    mapImage(vm, NULL);
+}
+
+void memoryDestroy(struct lc3_vm *vm) {
+    mapImage(vm, NULL);
+}
+
+uint16_t *copyPage(struct lc3_vm *vm, uint32_t page) {
+    uint16_t *copy = allocatePage();
+    memcpy(copy, vm->pages[page], PAGE_WORDS * sizeof(uint16_t));
+    vm->pages[page] = vm->privatePages[page] = copy;
+    return copy;
+}
+
+void memorySnapshot(const struct lc3_vm *vm, uint16_t *words) {
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        memcpy(words + (page << PAGE_SHIFT), vm->pages[page], PAGE_WORDS * sizeof(uint16_t));
+    }
+}
+
+struct lc3_image *stageImage(struct lc3_vm *vm) {
+    struct lc3_image *image = calloc(1, sizeof(struct lc3_image));
+    if (image) {
+        image->words = malloc(0x10000 * sizeof(uint16_t));
+    }
+    if (!image || !image->words) {
+        printf("Unable to allocate an image");
+        exit(-1);
+    }
+    memorySnapshot(vm, image->words);
+    return image;
+}
+
+void commitImage(struct lc3_vm *vm, struct lc3_image *image) {
+    image->hash = hashWords(image->words);
+    pthread_mutex_lock(&imagesLock);
+    struct lc3_image *shared = images;
+    while (shared && (shared->hash != image->hash || !sameWords(shared, image->words))) {
+        shared = shared->next;
+    }
+    if (shared) {
+        ++shared->references;
+    } else {
+        // only pages with a word set take memory
+        for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+            const uint16_t *words = image->words + (page << PAGE_SHIFT);
+            image->pages[page] = zeroPage;
+            if (!isZero(words)) {
+                image->pages[page] = memcpy(allocatePage(), words, PAGE_WORDS * sizeof(uint16_t));
+            }
+        }
+        free(image->words);
+        image->words = NULL;
+        image->references = 1;
+        image->next = images;
+        images = image;
+    }
+    pthread_mutex_unlock(&imagesLock);
+
+    if (shared) {
+        freeImage(image);
+        image = shared;
+    }
+    mapImage(vm, image);
+}
+
+void releaseImage(struct lc3_image *image) {
+    if (!image) {
+        return;
+    }
+    pthread_mutex_lock(&imagesLock);
+    int last = --image->references == 0;
+    if (last) {
+        struct lc3_image **link = &images;
+        while (*link != image) {
+            link = &(*link)->next;
+        }
+        *link = image->next;
+    }
+    pthread_mutex_unlock(&imagesLock);
+    if (last) {
+        freeImage(image);
+    }
+}
@@ -0,0 +1,139 @@
+#include "profile.h"
+
+static const char *const handlerNames[D_COUNT] = {
+        [D_DECODE] = "decode",
+        [D_ADD] = "ADD",
+        [D_ADD_IMM] = "ADD imm",
+        [D_AND] = "AND",
+        [D_AND_IMM] = "AND imm",
+        [D_BR] = "BR",
+        [D_BR_SPIN] = "BR (spin)",
+        [D_JMP] = "JMP",
+        [D_JSR] = "JSR",
+        [D_JSRR] = "JSRR",
+        [D_LD] = "LD",
+        [D_LDI] = "LDI",
+        [D_LDR] = "LDR",
+        [D_LEA] = "LEA",
+        [D_NOT] = "NOT",
+        [D_ST] = "ST",
+        [D_STI] = "STI",
+        [D_STR] = "STR",
+        [D_TRAP] = "TRAP",
+        [D_NOP] = "RTI/reserved",
+};
+
+struct profile_row {
+    uint16_t start;
+    uint16_t end;
+    uint64_t count;  // executions of the block, calls of the subroutine
+    uint64_t weight; // instructions, the sort key
+};
+
+void profileAttach(struct lc3_vm *vm, FILE *report) {
+    vm->profile = calloc(1, sizeof(struct lc3_profile));
+    if (!vm->profile) {
+        printf("Unable to allocate profile");
+        exit(-1);
+    }
+    vm->profile->report = report;
+    vm->profile->lastPc = 0x10000;
+}
+
+void profileDestroy(struct lc3_vm *vm) {
+    free(vm->profile);
+    vm->profile = NULL;
+}
+
+// keeps rows[] sorted by weight, at most PROFILE_REPORT_ROWS entries
+static void insertRow(struct profile_row *rows, int *count, struct profile_row row) {
+    if (*count == PROFILE_REPORT_ROWS && rows[*count - 1].weight >= row.weight) {
+        return;
+    }
+    int i = *count < PROFILE_REPORT_ROWS ? (*count)++ : *count - 1;
+    while (i > 0 && rows[i - 1].weight < row.weight) {
+        rows[i] = rows[i - 1];
+        --i;
+    }
+    rows[i] = row;
+}
+
+static int endsBlock(uint8_t handler) {
+    return handler == D_BR || handler == D_BR_SPIN || handler == D_JMP || handler == D_JSR || handler == D_JSRR ||
+           handler == D_TRAP;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * (double) part / (double) total : 0.0;
+}
+
+void profileReport(struct lc3_vm *vm) {
+    const struct lc3_profile *p = vm->profile;
+    FILE *out = p->report;
+    flockfile(out);
+
+    fprintf(out, "==== profile: %" PRIu64 " instructions ====\n\nopcodes\n", p->total);
+    for (int h = D_DECODE + 1; h < D_COUNT; ++h) {
+        if (p->handlerCount[h]) {
+            fprintf(out, "  %-14s %14" PRIu64 " %6.2f%%\n", handlerNames[h], p->handlerCount[h],
+                    percent(p->handlerCount[h], p->total));
+        }
+    }
+
+    struct profile_row rows[PROFILE_REPORT_ROWS];
+    int rowCount = 0;
+    for (int first = D_DECODE + 1; first < D_COUNT; ++first) {
+        for (int second = D_DECODE + 1; second < D_COUNT; ++second) {
+            uint64_t count = p->pairCount[first][second];
+            if (count) {
+                insertRow(rows, &rowCount, (struct profile_row) {first, second, count, count});
+            }
+        }
+    }
+    fprintf(out, "\nopcode pairs %29s\n", "sequential");
+    for (int i = 0; i < rowCount; ++i) {
+        fprintf(out, "  %-14s %-14s %14" PRIu64 " %6.2f%%\n", handlerNames[rows[i].start], handlerNames[rows[i].end],
+                rows[i].count, percent(rows[i].count, p->total));
+    }
+
+    // a block is a run of consecutive addresses executed equally often that only ends in a control transfer
+    rowCount = 0;
+    uint32_t pc = 0;
+    while (pc < 0x10000) {
+        uint64_t count = p->pcCount[pc];
+        if (!count) {
+            ++pc;
+            continue;
+        }
+        uint32_t start = pc;
+        while (pc + 1 < 0x10000 && p->pcCount[pc + 1] == count && !endsBlock(decode(memoryPeek(vm, pc)).handler)) {
+            ++pc;
+        }
+        insertRow(rows, &rowCount, (struct profile_row) {start, pc, count, count * (pc - start + 1)});
+        ++pc;
+    }
+    fprintf(out, "\nhot blocks %14s %14s %8s\n", "executions", "instructions", "share");
+    for (int i = 0; i < rowCount; ++i) {
+        fprintf(out, "  x%04X-x%04X %14" PRIu64 " %14" PRIu64 " %7.2f%%\n", rows[i].start, rows[i].end,
+                rows[i].count, rows[i].weight, percent(rows[i].weight, p->total));
+    }
+
+    rowCount = 0;
+    for (pc = 0; pc < 0x10000; ++pc) {
+        if (p->calls[pc]) {
+            insertRow(rows, &rowCount, (struct profile_row) {pc, pc, p->calls[pc], p->inclusive[pc]});
+        }
+    }
+    fprintf(out, "\nhot subroutines %9s %14s %8s %10s\n", "calls", "inclusive", "share", "per call");
+    for (int i = 0; i < rowCount; ++i) {
+        fprintf(out, "  x%04X %17" PRIu64 " %14" PRIu64 " %7.2f%% %10.1f\n", rows[i].start, rows[i].count,
+                rows[i].weight, percent(rows[i].weight, p->total), (double) rows[i].weight / (double) rows[i].count);
+    }
+    if (p->unmatchedReturns || p->depth) {
+        fprintf(out, "\n%" PRIu64 " returns without a call, %d calls without a return\n", p->unmatchedReturns,
+                p->depth);
+    }
+    fputc('\n', out);
+    fflush(out);
+    funlockfile(out);
+}
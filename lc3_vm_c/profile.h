@@ -0,0 +1,78 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    Exact guest profiler. While vm->profile is set runVm() uses the separate instrumented loop instead of
+    the regular dispatch loop (and instead of the JIT), so a guest without a profile pays nothing for it.
+
+    Every retired instruction bumps its PC and handler counters, and the counter of its pair with the
+    instruction before it if that one sits right in front of it in memory, the candidates for
+    superinstructions. JSR/JSRR push the callee and the instruction count at the call, JMP R7 (RET) pops it
+    and charges the instructions in between to the callee. Subroutine times include their callees, a
+    recursive subroutine is charged once per frame. The report is written when the guest is destroyed, so
+    guests stopped by a limit or that never halt get one too.
+*/
+
+#define PROFILE_STACK_DEPTH 1024
+#define PROFILE_REPORT_ROWS 10
+
+struct profile_frame {
+    uint16_t entry;
+    uint64_t start;
+};
+
+struct lc3_profile {
+    FILE *report;
+    uint64_t total;
+    uint64_t pcCount[0x10000];
+    uint64_t handlerCount[D_COUNT];
+    uint64_t pairCount[D_COUNT][D_COUNT]; // handlers of an instruction and the one right after it in memory
+    uint32_t lastPc;                      // 0x10000 before the first instruction
+    uint8_t lastHandler;
+
+    uint64_t calls[0x10000];     // per subroutine entry
+    uint64_t inclusive[0x10000]; // instructions between entering the subroutine and its RET
+    struct profile_frame stack[PROFILE_STACK_DEPTH];
+    int depth;                   // can exceed PROFILE_STACK_DEPTH, deeper frames are not tracked
+    uint64_t unmatchedReturns;
+};
+
+// attaches a profile that reports to `report` when the guest halts
+void profileAttach(struct lc3_vm *vm, FILE *report);
+
+void profileDestroy(struct lc3_vm *vm);
+
+void profileReport(struct lc3_vm *vm);
+
+static inline void profileCount(struct lc3_profile *p, uint16_t pc, uint8_t handler) {
+    ++p->pcCount[pc];
+    ++p->handlerCount[handler];
+    ++p->total;
+    if (pc == p->lastPc + 1) {
+        ++p->pairCount[p->lastHandler][handler];
+    }
+    p->lastPc = pc;
+    p->lastHandler = handler;
+}
+
+// call/return tracking, after the instruction ran
+static inline void profileControl(struct lc3_profile *p, uint16_t target, const struct lc3_decoded *d) {
+    if (d->handler == D_JSR || d->handler == D_JSRR) {
+        if (p->depth < PROFILE_STACK_DEPTH) {
+            p->stack[p->depth] = (struct profile_frame) {target, p->total};
+        }
+        ++p->depth;
+        ++p->calls[target];
+    } else if (d->handler == D_JMP && d->sr1 == R_R7) {
+        if (p->depth == 0) {
+            ++p->unmatchedReturns;
+            return;
+        }
+        --p->depth;
+        if (p->depth < PROFILE_STACK_DEPTH) {
+            struct profile_frame *frame = &p->stack[p->depth];
+            p->inclusive[frame->entry] += p->total - frame->start;
+        }
+    }
+}
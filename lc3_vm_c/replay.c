@@ -0,0 +1,107 @@
+#include "replay.h"
+#include <string.h>
+
+#define REPLAY_HEADER "yavm-input 1"
+
+static void loadEvents(struct lc3_replay *replay, const char *path) {
+    FILE *file = fopen(path, "r");
+    char header[32];
+    if (!file || !fgets(header, sizeof(header), file) ||
+        strncmp(header, REPLAY_HEADER, strlen(REPLAY_HEADER)) != 0) {
+        printf("%s is not an input log\n", path);
+        exit(-1);
+    }
+    size_t capacity = 0;
+    uint64_t at;
+    unsigned value;
+    while (fscanf(file, "%" SCNu64 " %u", &at, &value) == 2) {
+        if (replay->eventCount == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            replay->events = realloc(replay->events, capacity * sizeof(struct input_event));
+            if (!replay->events) {
+                printf("Unable to allocate input log");
+                exit(-1);
+            }
+        }
+        replay->events[replay->eventCount++] = (struct input_event) {at, (uint16_t) value};
+    }
+    fclose(file);
+}
+
+void replayAttach(struct lc3_vm *vm, const char *path, int mode) {
+    struct lc3_replay *replay = calloc(1, sizeof(struct lc3_replay));
+    if (!replay) {
+        printf("Unable to allocate input log");
+        exit(-1);
+    }
+    replay->mode = mode;
+    if (mode == REPLAY_RECORD) {
+        replay->file = fopen(path, "w");
+        if (!replay->file) {
+            printf("Failed to open %s\n", path);
+            exit(-1);
+        }
+        fprintf(replay->file, REPLAY_HEADER "\n");
+    } else {
+        loadEvents(replay, path);
+    }
+    vm->replay = replay;
+}
+
+void replayDestroy(struct lc3_vm *vm) {
+    struct lc3_replay *replay = vm->replay;
+    if (!replay) {
+        return;
+    }
+    if (replay->file) {
+        fclose(replay->file);
+    }
+    free(replay->events);
+    free(replay);
+    vm->replay = NULL;
+}
+
+static void logEvent(struct lc3_vm *vm, uint16_t value) {
+    struct lc3_replay *replay = vm->replay;
+    if (replay->eofLogged) {
+        return;
+    }
+    fprintf(replay->file, "%" PRIu64 " %u\n", vm->instructionCount, value);
+    replay->eofLogged = value == 0xFFFF;
+}
+
+int replayReady(struct lc3_vm *vm) {
+    struct lc3_replay *replay = vm->replay;
+    if (replay->mode == REPLAY_PLAY) {
+        return replay->next == replay->eventCount || replay->events[replay->next].at <= vm->instructionCount;
+    }
+    if (!keyboardReady(&vm->keyboard)) {
+        return 0;
+    }
+    if (!replay->headLogged) {
+        logEvent(vm, keyboardPeek(&vm->keyboard));
+        replay->headLogged = 1;
+    }
+    return 1;
+}
+
+uint16_t replayRead(struct lc3_vm *vm) {
+    struct lc3_replay *replay = vm->replay;
+    if (replay->mode == REPLAY_PLAY) {
+        if (replay->next == replay->eventCount) {
+            return 0xFFFF;
+        }
+        uint16_t value = replay->events[replay->next].value;
+        // end of input is sticky
+        if (value != 0xFFFF) {
+            ++replay->next;
+        }
+        return value;
+    }
+    uint16_t value = keyboardRead(&vm->keyboard);
+    if (!replay->headLogged) {
+        logEvent(vm, value);
+    }
+    replay->headLogged = 0;
+    return value;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    Deterministic record/replay of guest input.
+
+    The guest observes input in two ways: KBSR turning ready and the byte it then gets from KBDR, GETC or
+    IN. Recording logs every input byte together with the instruction count at which the guest first saw
+    it, either as a ready KBSR or by consuming it directly. Replay makes KBSR ready at exactly those counts
+    and hands out the logged bytes, so a replayed run retires the same instruction stream as the recorded
+    one regardless of timing. A value of 0xFFFF marks end of input, after which input stays at EOF.
+
+    Instruction counts have to be exact, so a guest with a log attached runs through the instrumented loop
+    (like the profiler) and never through the JIT. The log is a text file, one "<count> <value>" per line
+    after a "yavm-input 1" header.
+*/
+
+enum {
+    REPLAY_RECORD,
+    REPLAY_PLAY,
+};
+
+struct input_event {
+    uint64_t at;
+    uint16_t value;
+};
+
+struct lc3_replay {
+    int mode;
+    FILE *file;        // REPLAY_RECORD
+    int headLogged;    // the byte at the keyboard head has been logged already
+    int eofLogged;
+
+    struct input_event *events; // REPLAY_PLAY
+    size_t eventCount;
+    size_t next;
+};
+
+void replayAttach(struct lc3_vm *vm, const char *path, int mode);
+
+void replayDestroy(struct lc3_vm *vm);
+
+// KBSR
+int replayReady(struct lc3_vm *vm);
+
+// KBDR, GETC and IN
+uint16_t replayRead(struct lc3_vm *vm);
@@ -0,0 +1,263 @@
+#include "scheduler.h"
+
+struct worker {
+    struct scheduler *scheduler;
+    int index;
+};
+
+struct scheduler *createScheduler(int workers, uint64_t slice) {
+    if (workers < 1 || workers > SCHEDULER_MAX_WORKERS) {
+        printf("Worker count must be between 1 and %d\n", SCHEDULER_MAX_WORKERS);
+        exit(-1);
+    }
+    struct scheduler *s = calloc(1, sizeof(struct scheduler));
+    if (!s || pipe(s->wakeup) != 0) {
+        printf("Failed to create the scheduler\n");
+        exit(-1);
+    }
+    fcntl(s->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->wakeup[1], F_SETFL, O_NONBLOCK);
+    s->workerCount = workers;
+    s->slice = slice;
+    for (int i = 0; i < workers; ++i) {
+        pthread_mutex_init(&s->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&s->idleLock, NULL);
+    pthread_cond_init(&s->idle, NULL);
+    pthread_mutex_init(&s->parkLock, NULL);
+    return s;
+}
+
+void destroyScheduler(struct scheduler *s) {
+    for (int i = 0; i < s->workerCount; ++i) {
+        pthread_mutex_destroy(&s->deques[i].lock);
+        free(s->deques[i].slots);
+    }
+    pthread_mutex_destroy(&s->idleLock);
+    pthread_cond_destroy(&s->idle);
+    pthread_mutex_destroy(&s->parkLock);
+    close(s->wakeup[0]);
+    close(s->wakeup[1]);
+    free(s->guests);
+    free(s->parked);
+    free(s);
+}
+
+void schedulerAdd(struct scheduler *s, struct lc3_vm *vm) {
+    if (s->guestCount == s->guestCapacity) {
+        s->guestCapacity = s->guestCapacity ? s->guestCapacity * 2 : 16;
+        s->guests = realloc(s->guests, s->guestCapacity * sizeof(struct lc3_vm *));
+        if (!s->guests) {
+            printf("Failed to add a guest to the scheduler\n");
+            exit(-1);
+        }
+    }
+    s->guests[s->guestCount++] = vm;
+}
+
+static void wakePoller(struct scheduler *s) {
+    char c = 0;
+    if (write(s->wakeup[1], &c, 1) != 1) {
+        // the pipe is full, so the poller is going to wake up anyway
+    }
+}
+
+static void pushBack(struct scheduler *s, int worker, struct lc3_vm *vm) {
+    struct sched_deque *q = &s->deques[worker];
+    pthread_mutex_lock(&q->lock);
+    q->slots[(q->head + q->size) % s->guestCount] = vm;
+    ++q->size;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&s->idleLock);
+    ++s->queued;
+    pthread_cond_signal(&s->idle);
+    pthread_mutex_unlock(&s->idleLock);
+}
+
+static struct lc3_vm *popFront(struct sched_deque *q, int capacity) {
+    struct lc3_vm *vm = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->size) {
+        vm = q->slots[q->head];
+        q->head = (q->head + 1) % capacity;
+        --q->size;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return vm;
+}
+
+static struct lc3_vm *stealBack(struct sched_deque *q, int capacity) {
+    struct lc3_vm *vm = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->size) {
+        --q->size;
+        vm = q->slots[(q->head + q->size) % capacity];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return vm;
+}
+
+// waits for a runnable guest, NULL once every guest has halted
+static struct lc3_vm *take(struct scheduler *s, int worker) {
+    pthread_mutex_lock(&s->idleLock);
+    while (s->queued == 0 && s->live > 0) {
+        pthread_cond_wait(&s->idle, &s->idleLock);
+    }
+    if (s->live == 0) {
+        pthread_mutex_unlock(&s->idleLock);
+        return NULL;
+    }
+    --s->queued;
+    pthread_mutex_unlock(&s->idleLock);
+
+    // the reservation guarantees there is a guest in some deque, own work first, then steal
+    for (;;) {
+        struct lc3_vm *vm = popFront(&s->deques[worker], s->guestCount);
+        for (int i = 1; !vm && i < s->workerCount; ++i) {
+            vm = stealBack(&s->deques[(worker + i) % s->workerCount], s->guestCount);
+        }
+        if (vm) {
+            return vm;
+        }
+    }
+}
+
+static void halted(struct scheduler *s) {
+    pthread_mutex_lock(&s->idleLock);
+    int live = --s->live;
+    if (live == 0) {
+        pthread_cond_broadcast(&s->idle);
+    }
+    pthread_mutex_unlock(&s->idleLock);
+    if (live == 0) {
+        wakePoller(s);
+    }
+}
+
+static void park(struct scheduler *s, struct lc3_vm *vm) {
+    pthread_mutex_lock(&s->parkLock);
+    s->parked[s->parkedCount++] = vm;
+    pthread_mutex_unlock(&s->parkLock);
+    wakePoller(s);
+}
+
+static void *workerMain(void *arg) {
+    struct worker *w = arg;
+    struct scheduler *s = w->scheduler;
+    struct lc3_vm *vm;
+    while ((vm = take(s, w->index))) {
+        switch (runVm(vm, s->slice)) {
+            case VM_HALTED:
+            case VM_STOPPED:
+                halted(s);
+                break;
+            case VM_BLOCKED:
+                park(s, vm);
+                break;
+            default:
+                pushBack(s, w->index, vm);
+        }
+    }
+    return NULL;
+}
+
+// moves parked guests back to the deques once their input is readable
+static void *pollerMain(void *arg) {
+    struct scheduler *s = arg;
+    struct pollfd *fds = malloc((s->guestCount + 1) * sizeof(struct pollfd));
+    struct lc3_vm **waiting = malloc(s->guestCount * sizeof(struct lc3_vm *));
+    int next = 0;
+    for (;;) {
+        pthread_mutex_lock(&s->idleLock);
+        int live = s->live;
+        pthread_mutex_unlock(&s->idleLock);
+        if (live == 0) {
+            break;
+        }
+
+        // parked guests can still run out of time, wake up for the earliest deadline
+        uint64_t deadline = 0;
+        pthread_mutex_lock(&s->parkLock);
+        int count = s->parkedCount;
+        for (int i = 0; i < count; ++i) {
+            waiting[i] = s->parked[i];
+            fds[i] = (struct pollfd) {s->parked[i]->keyboard.fd, POLLIN, 0};
+            if (waiting[i]->deadline && (!deadline || waiting[i]->deadline < deadline)) {
+                deadline = waiting[i]->deadline;
+            }
+        }
+        pthread_mutex_unlock(&s->parkLock);
+        fds[count] = (struct pollfd) {s->wakeup[0], POLLIN, 0};
+
+        int timeout = -1;
+        if (deadline) {
+            uint64_t current = monotonicNs();
+            timeout = deadline > current ? (int) ((deadline - current + 999999) / 1000000) : 0;
+        }
+        if (poll(fds, count + 1, timeout) < 0) {
+            continue;
+        }
+        if (fds[count].revents) {
+            char drain[64];
+            if (read(s->wakeup[0], drain, sizeof(drain)) < 0) {
+                // nothing to drain
+            }
+        }
+        uint64_t current = deadline ? monotonicNs() : 0;
+        for (int i = 0; i < count; ++i) {
+            int expired = waiting[i]->deadline && current >= waiting[i]->deadline;
+            if (!fds[i].revents && !expired) {
+                continue;
+            }
+            pthread_mutex_lock(&s->parkLock);
+            for (int j = 0; j < s->parkedCount; ++j) {
+                if (s->parked[j] == waiting[i]) {
+                    s->parked[j] = s->parked[--s->parkedCount];
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&s->parkLock);
+            if (expired) {
+                stopVm(waiting[i], STOP_TIMEOUT);
+                halted(s);
+                continue;
+            }
+            pushBack(s, next, waiting[i]);
+            next = (next + 1) % s->workerCount;
+        }
+    }
+    free(fds);
+    free(waiting);
+    return NULL;
+}
+
+void schedulerRun(struct scheduler *s) {
+    if (s->guestCount == 0) {
+        return;
+    }
+    s->live = s->guestCount;
+    s->parked = malloc(s->guestCount * sizeof(struct lc3_vm *));
+    for (int i = 0; i < s->workerCount; ++i) {
+        free(s->deques[i].slots);
+        s->deques[i].slots = malloc(s->guestCount * sizeof(struct lc3_vm *));
+        s->deques[i].head = 0;
+        s->deques[i].size = 0;
+    }
+    for (int i = 0; i < s->guestCount; ++i) {
+        pushBack(s, i % s->workerCount, s->guests[i]);
+    }
+
+    pthread_t poller;
+    pthread_t threads[SCHEDULER_MAX_WORKERS];
+    struct worker workers[SCHEDULER_MAX_WORKERS];
+    pthread_create(&poller, NULL, pollerMain, s);
+    for (int i = 0; i < s->workerCount; ++i) {
+        workers[i] = (struct worker) {s, i};
+        pthread_create(&threads[i], NULL, workerMain, &workers[i]);
+    }
+    for (int i = 0; i < s->workerCount; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(poller, NULL);
+}
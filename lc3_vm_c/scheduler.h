@@ -0,0 +1,57 @@
+#pragma once
+
+#include "vm.h"
+#include <pthread.h>
+
+/*
+    Runs many guests on a fixed pool of worker threads.
+
+    Every worker owns a deque of runnable guests. It pops from the front, runs the guest for one slice of
+    instructions and pushes it to the back again, so guests on one worker are served round robin. A worker
+    whose deque is empty steals from the back of another one. Guests that wait for input (see
+    lc3_vm.parkOnInput) are parked and handed to a poller thread, which puts them back on a deque once their
+    input fd becomes readable, or stops them once their time limit passes. Halted and stopped guests leave the
+    scheduler; schedulerRun() returns when none are left.
+*/
+
+#define SCHEDULER_DEFAULT_SLICE 100000
+#define SCHEDULER_MAX_WORKERS 64
+
+struct sched_deque {
+    pthread_mutex_t lock;
+    struct lc3_vm **slots; // ring buffer with room for every guest of the scheduler
+    int head;
+    int size;
+};
+
+struct scheduler {
+    int workerCount;
+    uint64_t slice;
+    struct sched_deque deques[SCHEDULER_MAX_WORKERS];
+
+    struct lc3_vm **guests;
+    int guestCount;
+    int guestCapacity;
+
+    // guests waiting in a deque, every worker that takes one reserves it here first
+    int queued;
+    // guests that have not halted yet
+    int live;
+    pthread_mutex_t idleLock;
+    pthread_cond_t idle;
+
+    struct lc3_vm **parked;
+    int parkedCount;
+    pthread_mutex_t parkLock;
+    int wakeup[2]; // self-pipe that interrupts the poller when a guest gets parked or the last one halts
+};
+
+struct scheduler *createScheduler(int workers, uint64_t slice);
+
+void destroyScheduler(struct scheduler *s);
+
+// the guest must be loaded and started with startVm(), it stays owned by the caller
+void schedulerAdd(struct scheduler *s, struct lc3_vm *vm);
+
+// runs every added guest until it halts
+void schedulerRun(struct scheduler *s);
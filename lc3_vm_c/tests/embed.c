@@ -0,0 +1,297 @@
+#include "yavm.h"
+#include <string.h>
+
+/*
+    Drives guests through libyavm like an embedding program does and checks what it sees: devices, also over
+    code that already ran, stepping in slices of any size with and without the JIT, images shared between
+    guests, breakpoints, watchpoints, condition codes, code rewritten under a superinstruction, switching the
+    input and the user pointers of the hooks.
+    yavm_embed_test <objs dir> <tests dir>
+*/
+
+#define STEPS 1000003
+
+static int failures;
+
+#define CHECK(condition, ...) do {                      \
+        if (!(condition)) {                             \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                        \
+            printf("\n");                               \
+            ++failures;                                 \
+        }                                               \
+    } while (0)
+
+// .obj images are big-endian words, the first one is the origin
+static void loadWords(struct lc3_vm *vm, const uint16_t *words, size_t count) {
+    uint8_t bytes[64];
+    for (size_t i = 0; i < count; ++i) {
+        bytes[2 * i] = (uint8_t) (words[i] >> 8);
+        bytes[2 * i + 1] = (uint8_t) words[i];
+    }
+    yavmLoadImageBuffer(vm, bytes, count * 2);
+}
+
+static struct lc3_vm *createGuest(const char *image, const char *input, int jit) {
+    struct lc3_vm *vm = yavmCreate();
+    if (!input) {
+        input = "/dev/null";
+    }
+    int inputFd = open(input, O_RDONLY);
+    int outputFd = open("/dev/null", O_WRONLY);
+    if (inputFd < 0 || outputFd < 0) {
+        printf("Failed to open %s\n", input);
+        exit(-1);
+    }
+    yavmSetIo(vm, inputFd, outputFd);
+    if (image) {
+        yavmLoadImage(vm, image);
+    }
+    if (jit) {
+        yavmEnableJit(vm);
+    }
+    return vm;
+}
+
+// the guest does not own its fds, they are closed once it is gone
+static void destroyGuest(struct lc3_vm *vm) {
+    int inputFd = vm->keyboard.fd;
+    int outputFd = vm->outputFd;
+    yavmDestroy(vm);
+    close(inputFd);
+    close(outputFd);
+}
+
+static uint64_t fingerprint(struct lc3_vm *vm) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int r = 0; r < R_COUNT; ++r) {
+        hash = (hash ^ yavmGetRegister(vm, r)) * 1099511628211ull;
+    }
+    for (uint32_t address = 0; address < 0x10000; ++address) {
+        hash = (hash ^ yavmReadMemory(vm, (uint16_t) address)) * 1099511628211ull;
+    }
+    return (hash ^ yavmInstructionCount(vm)) * 1099511628211ull;
+}
+
+// runs STEPS instructions of 2048 in slices of 1 to `maxSlice` instructions
+static uint64_t runSliced(const char *image, const char *input, int jit, uint64_t maxSlice) {
+    struct lc3_vm *vm = createGuest(image, input, jit);
+    uint64_t slice = 0;
+    while (yavmInstructionCount(vm) < STEPS) {
+        uint64_t left = STEPS - yavmInstructionCount(vm);
+        slice = slice % maxSlice + 1;
+        int status = yavmStep(vm, slice < left ? slice : left);
+        if (status == VM_HALTED || status == VM_STOPPED) {
+            break;
+        }
+    }
+    CHECK(yavmInstructionCount(vm) == STEPS, "%s ran %" PRIu64 " instructions instead of %d",
+          jit ? "JIT" : "interpreter", yavmInstructionCount(vm), STEPS);
+    uint64_t hash = fingerprint(vm);
+    destroyGuest(vm);
+    return hash;
+}
+
+static void checkSlices(const char *image, const char *input) {
+    uint64_t reference = runSliced(image, input, 0, 1 << 20);
+    CHECK(runSliced(image, input, 0, 37) == reference, "interpreter state depends on the slice sizes");
+    CHECK(runSliced(image, input, 1, 1 << 20) == reference, "JIT state differs from the interpreter");
+    CHECK(runSliced(image, input, 1, 37) == reference, "JIT state depends on the slice sizes");
+}
+
+static void checkSharedImage(const char *image) {
+    struct lc3_vm *a = createGuest(image, NULL, 0);
+    struct lc3_vm *b = createGuest(image, NULL, 0);
+    uint16_t word = yavmReadMemory(a, 0x3000);
+    uint16_t flipped = (uint16_t) ~word;
+    yavmWriteMemory(a, 0x3000, flipped);
+    CHECK(yavmReadMemory(a, 0x3000) == flipped, "a write to a shared image got lost");
+    CHECK(yavmReadMemory(b, 0x3000) == word, "a write to a shared image showed up in another guest");
+    destroyGuest(a);
+    destroyGuest(b);
+}
+
+static uint16_t deviceWritten;
+
+static int readDevice(void *user, uint16_t address, uint16_t *value) {
+    (void) user;
+    if (address != 0x4000) {
+        return 0;
+    }
+    *value = 42;
+    return 1;
+}
+
+static int writeDevice(void *user, uint16_t address, uint16_t value) {
+    (void) user;
+    (void) address;
+    deviceWritten = value;
+    return 1;
+}
+
+static void checkDevices(int jit) {
+    // LDI R0, x3007 ; ADD R0, R0, #1 ; STI R0, x3008 ; LEA R1, x3007 ; LDR R2, R1, #0 ; LDR R3, R2, #1 ; HALT
+    static const uint16_t program[] = {0x3000, 0xA006, 0x1021, 0xB005, 0xE203, 0x6440, 0x6681, 0xF025, 0x4000, 0x4001};
+    struct lc3_vm *vm = createGuest(NULL, NULL, jit);
+    loadWords(vm, program, sizeof(program) / sizeof(program[0]));
+    yavmWriteMemory(vm, 0x4001, 7);
+    struct lc3_device *device = yavmAddDevice(vm, 0x4000, 0x4001, readDevice, writeDevice, NULL);
+    deviceWritten = 0;
+    CHECK(yavmStep(vm, 1000) == VM_HALTED, "device program did not halt");
+    // x4001 is claimed for stores only, loads fall through to memory
+    CHECK(yavmGetRegister(vm, R_R0) == 43 && deviceWritten == 43 && yavmGetRegister(vm, R_R3) == 7,
+          "device accesses went wrong: R0 %u, written %u, R3 %u", yavmGetRegister(vm, R_R0), deviceWritten,
+          yavmGetRegister(vm, R_R3));
+    CHECK(yavmReadMemory(vm, 0x4001) == 7, "a store taken by a device reached memory");
+
+    yavmRemoveDevice(vm, device);
+    yavmReset(vm);
+    CHECK(yavmStep(vm, 1000) == VM_HALTED, "device program did not halt without the device");
+    CHECK(yavmGetRegister(vm, R_R0) == 1 && yavmGetRegister(vm, R_R3) == 1,
+          "removed device still answered: R0 %u, R3 %u", yavmGetRegister(vm, R_R0), yavmGetRegister(vm, R_R3));
+    destroyGuest(vm);
+}
+
+static int patchInstruction(void *user, uint16_t address, uint16_t *value) {
+    (void) user;
+    if (address != 0x3001) {
+        return 0;
+    }
+    *value = 0x1022; // ADD R0, R0, #2
+    return 1;
+}
+
+static void checkDeviceOverCode(int jit) {
+    // AND R0, R0, #0 ; ADD R0, R0, #1 ; HALT
+    static const uint16_t program[] = {0x3000, 0x5020, 0x1021, 0xF025};
+    struct lc3_vm *vm = createGuest(NULL, NULL, jit);
+    loadWords(vm, program, sizeof(program) / sizeof(program[0]));
+    CHECK(yavmStep(vm, 1000) == VM_HALTED && yavmGetRegister(vm, R_R0) == 1, "code without a device went wrong");
+
+    // the code has been predecoded and translated by now, fetches have to go through the device from now on
+    struct lc3_device *device = yavmAddDevice(vm, 0x3001, 0x3001, patchInstruction, NULL, NULL);
+    yavmReset(vm);
+    CHECK(yavmStep(vm, 1000) == VM_HALTED && yavmGetRegister(vm, R_R0) == 2,
+          "code on a page that got a device ran from memory, R0 %u", yavmGetRegister(vm, R_R0));
+
+    yavmRemoveDevice(vm, device);
+    yavmReset(vm);
+    CHECK(yavmStep(vm, 1000) == VM_HALTED && yavmGetRegister(vm, R_R0) == 1,
+          "code on a page that lost its device still ran the device's word, R0 %u", yavmGetRegister(vm, R_R0));
+    destroyGuest(vm);
+}
+
+static void *trapUser;
+
+static int recordTrap(void *user, struct lc3_vm *vm, uint16_t vector) {
+    (void) vm;
+    (void) vector;
+    trapUser = user;
+    return 0;
+}
+
+static int ignoreDevice(void *user, uint16_t address, uint16_t *value) {
+    (void) user;
+    (void) address;
+    (void) value;
+    return 0;
+}
+
+static void checkHookData(void) {
+    // OUT ; HALT
+    static const uint16_t program[] = {0x3000, 0xF021, 0xF025};
+    int trapContext;
+    int mmioContext;
+    struct lc3_vm *vm = createGuest(NULL, NULL, 0);
+    loadWords(vm, program, sizeof(program) / sizeof(program[0]));
+    yavmSetTrapHandler(vm, recordTrap, &trapContext);
+    yavmSetMmio(vm, ignoreDevice, NULL, &mmioContext);
+    trapUser = NULL;
+    CHECK(yavmStep(vm, 1000) == VM_HALTED && trapUser == &trapContext,
+          "the trap handler got the MMIO callbacks' user pointer");
+    destroyGuest(vm);
+}
+
+static void checkDebugging(int jit) {
+    // AND R0, R0, #0 ; ADD R0, R0, #5 ; ST R0, x3005 ; HALT
+    static const uint16_t program[] = {0x3000, 0x5020, 0x1025, 0x3002, 0xF025, 0x0000, 0x0000};
+    struct lc3_vm *vm = createGuest(NULL, NULL, jit);
+    loadWords(vm, program, sizeof(program) / sizeof(program[0]));
+
+    struct yavm_until until = {0x3002, -1, 0};
+    CHECK(yavmRunUntil(vm, &until) == VM_BREAK && yavmGetRegister(vm, R_PC) == 0x3002,
+          "breakpoint at x3002 missed, PC %04X", yavmGetRegister(vm, R_PC));
+    CHECK(yavmGetRegister(vm, R_COND) == FL_POS, "COND reads %u after a positive result",
+          yavmGetRegister(vm, R_COND));
+
+    uint16_t address;
+    uint16_t oldValue;
+    uint16_t newValue;
+    CHECK(!yavmWatch(vm, 0x3005, 0x3004, 1), "a watch ending before its start was taken");
+    yavmWatch(vm, 0x3005, 0x3005, 1);
+    CHECK(yavmStep(vm, 1000) == VM_BREAK && yavmWatchHit(vm, &address, &oldValue, &newValue) &&
+          address == 0x3005 && oldValue == 0 && newValue == 5, "watchpoint at x3005 missed");
+    yavmWatch(vm, 0x3005, 0x3005, 0);
+    CHECK(yavmStep(vm, 1000) == VM_HALTED, "debugged program did not halt");
+
+    yavmSetRegister(vm, R_COND, FL_NEG);
+    CHECK(yavmGetRegister(vm, R_COND) == FL_NEG, "COND set to FL_NEG reads %u", yavmGetRegister(vm, R_COND));
+
+    // AND + ADD ran as one superinstruction, rewriting the ADD must drop it: ADD R0, R0, #7
+    yavmWriteMemory(vm, 0x3001, 0x1027);
+    yavmReset(vm);
+    CHECK(yavmStep(vm, 1000) == VM_HALTED && yavmGetRegister(vm, R_R0) == 7,
+          "rewritten second instruction of a superinstruction did not run, R0 %u", yavmGetRegister(vm, R_R0));
+    destroyGuest(vm);
+}
+
+static void checkInputSwitch(const char *input) {
+    // GETC ; HALT
+    static const uint16_t program[] = {0x3000, 0xF020, 0xF025};
+    struct lc3_vm *vm = createGuest(NULL, NULL, 0);
+    loadWords(vm, program, sizeof(program) / sizeof(program[0]));
+    CHECK(yavmStep(vm, 1000) == VM_HALTED && yavmGetRegister(vm, R_R0) == 0xFFFF,
+          "GETC at end of input read %04X", yavmGetRegister(vm, R_R0));
+
+    int inputFd = open(input, O_RDONLY);
+    char first;
+    if (inputFd < 0 || read(inputFd, &first, 1) != 1 || lseek(inputFd, 0, SEEK_SET) != 0) {
+        printf("Failed to read %s\n", input);
+        exit(-1);
+    }
+    int oldInputFd = vm->keyboard.fd;
+    yavmSetIo(vm, inputFd, vm->outputFd);
+    close(oldInputFd);
+    yavmReset(vm);
+    CHECK(yavmStep(vm, 1000) == VM_HALTED && yavmGetRegister(vm, R_R0) == (uint16_t) first,
+          "GETC after switching the input read %04X instead of %04X", yavmGetRegister(vm, R_R0), first);
+    destroyGuest(vm);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("Usage: yavm_embed_test <objs dir> <tests dir>\n");
+        return 2;
+    }
+    char image[4096];
+    char input[4096];
+    snprintf(image, sizeof(image), "%s/2048.obj", argv[1]);
+    snprintf(input, sizeof(input), "%s/2048.in", argv[2]);
+
+    for (int jit = 0; jit < 2; ++jit) {
+        checkDevices(jit);
+        checkDeviceOverCode(jit);
+        checkDebugging(jit);
+    }
+    checkSlices(image, input);
+    checkSharedImage(image);
+    checkInputSwitch(input);
+    checkHookData();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,48 @@
+# Runs the bundled games headless with an instruction cap in every dispatch mode of the VM. They all have to stop
+# after exactly that many instructions with the same output.
+#   cmake -DVM=<vm_c> -DVM_SWITCH=<vm_c_switch> -DVM_THREADED=<vm_c_threaded> -DJIT=<ON|OFF> -DOBJS=<objs dir>
+#         -DINPUTS=<tests dir> -P smoke.cmake
+
+set(LIMIT 1500001)
+
+# vm_c itself runs the register-pinned threaded loop when built with the default options
+set(modes switch threaded pinned profile)
+if (JIT)
+    list(APPEND modes jit)
+endif ()
+
+foreach (game 2048 rogue)
+    unset(reference)
+    foreach (mode ${modes})
+        set(vm ${VM})
+        set(flags -H -n ${LIMIT})
+        if (mode STREQUAL "switch")
+            set(vm ${VM_SWITCH})
+        elseif (mode STREQUAL "threaded")
+            set(vm ${VM_THREADED})
+        elseif (mode STREQUAL "profile")
+            list(APPEND flags -p ${CMAKE_CURRENT_BINARY_DIR}/smoke_${game}.profile)
+        elseif (mode STREQUAL "jit")
+            list(APPEND flags -j)
+        endif ()
+        execute_process(COMMAND ${vm} ${flags} ${OBJS}/${game}.obj:${INPUTS}/${game}.in
+                OUTPUT_VARIABLE output ERROR_VARIABLE errors RESULT_VARIABLE status)
+        if (NOT errors MATCHES "stopped after ${LIMIT} instructions")
+            message(FATAL_ERROR "${game} (${mode}) did not stop after ${LIMIT} instructions: ${errors}")
+        endif ()
+        if (mode STREQUAL "profile")
+            file(READ ${CMAKE_CURRENT_BINARY_DIR}/smoke_${game}.profile report)
+            if (NOT report MATCHES "profile: ${LIMIT} instructions")
+                message(FATAL_ERROR "${game} (${mode}) wrote no profile for its ${LIMIT} instructions")
+            endif ()
+        endif ()
+        string(MD5 hash "${output}")
+        if (NOT reference)
+            set(reference ${hash})
+            set(referenceMode ${mode})
+        elseif (NOT hash STREQUAL reference)
+            message(FATAL_ERROR "${game} (${mode}) printed something else than in ${referenceMode} mode")
+        endif ()
+        message(STATUS "${game} (${mode}) stopped after ${LIMIT} instructions, output ${hash}")
+    endforeach ()
+endforeach ()
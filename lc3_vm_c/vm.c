@@ -1,309 +1,1142 @@
 #include "vm.h"
+#include "profile.h"
+#include "replay.h"
+#include "debug.h"
+#include "device.h"
+#include <string.h>
+#include <errno.h>
 
+#ifdef YAVM_JIT
+#include "jit.h"
+#endif
 
-uint16_t signExtend(uint16_t x, int bit_count) {
-    if ((x >> (bit_count - 1)) & 0x1) {
-        x |= (0xFFFF << bit_count);
-    }
-    return x;
+
+uint16_t toLittleEndian16(uint16_t x) {
+    return (x << 8) | (x >> 8);
 }
 
-uint16_t checkKey() {
-    static fd_set fdSet;
-    FD_ZERO(&fdSet);
-    FD_SET(STDIN_FILENO, &fdSet);
+// the guest that switched the terminal to raw mode, restored by the SIGINT handler
+static struct lc3_vm *terminalOwner;
+
+static int consoleRead(void *data, uint16_t address, uint16_t *value);
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &fdSet, NULL, NULL, &timeout) != 0;
+struct lc3_vm *createVm() {
+    struct lc3_vm *vm = calloc(1, sizeof(struct lc3_vm));
+    if (!vm) {
+        printf("Unable to allocate VM");
+        exit(-1);
+    }
+    memoryInit(vm);
+    deviceAdd(vm, MR_KBSR, MR_DDR, consoleRead, NULL, vm);
+    keyboardInit(&vm->keyboard, STDIN_FILENO);
+    vm->outputFd = STDOUT_FILENO;
+    vm->flushInterval = OUTPUT_FLUSH_INTERVAL_NS;
+    vm->breakPc = -1;
+    vm->breakTrap = -1;
+    return vm;
 }
 
-uint16_t toLittleEndian16(uint16_t x) {
-    return (x << 8) | (x >> 8);
+void destroyVm(struct lc3_vm *vm) {
+    flushOutput(vm);
+    keyboardStop(&vm->keyboard);
+    // however the run ended, HALT, a limit or a guest that never halts
+    if (vm->profile) {
+        profileReport(vm);
+    }
+    profileDestroy(vm);
+    replayDestroy(vm);
+    debugDestroy(vm);
+#ifdef YAVM_JIT
+    jitDestroy(vm);
+#endif
+    if (terminalOwner == vm) {
+        terminalOwner = NULL;
+    }
+    deviceDestroy(vm);
+    memoryDestroy(vm);
+    free(vm);
 }
 
-void disableInputBuffering() {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new = original_tio;
+void disableInputBuffering(struct lc3_vm *vm) {
+    tcgetattr(STDIN_FILENO, &vm->original_tio);
+    struct termios new = vm->original_tio;
     new.c_lflag &= ~ICANON & ~ECHO;
     tcsetattr(STDIN_FILENO, TCSANOW, &new);
 }
 
-void restoreInputBuffering() {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+void restoreInputBuffering(struct lc3_vm *vm) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &vm->original_tio);
 }
 
 void handleInterrupt() {
-    restoreInputBuffering();
+    if (terminalOwner) {
+        flushOutput(terminalOwner);
+        restoreInputBuffering(terminalOwner);
+    }
     printf("\n");
     exit(-2);
 }
 
-void setup() {
+void setup(struct lc3_vm *vm) {
+    terminalOwner = vm;
     signal(SIGINT, handleInterrupt);
-    disableInputBuffering();
+    disableInputBuffering(vm);
 }
 
-uint16_t memoryRead(uint16_t address) {
-    if (address == MR_KBSR) {
-        static fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO, &readfds);
-
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 0;
+uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
 
-        return select(1, &readfds, NULL, NULL, &timeout) ? STATUS_BIT : 0;
-    } else if (address == MR_KBDR) {
-        if (memoryRead(MR_KBSR)) {
-            return getchar();
-        } else {
-            return 0;
+void flushOutput(struct lc3_vm *vm) {
+    int written = 0;
+    while (written < vm->outputSize) {
+        ssize_t n = write(vm->outputFd, vm->outputBuffer + written, vm->outputSize - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-    } else if (address == MR_DSR) {
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // a nonblocking output fd is full, wait until it drains instead of losing what it did not take
+            struct pollfd pfd = {vm->outputFd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n <= 0) {
+            // EPIPE or another hard error, nobody is reading anymore: drop the output like a closed stdout would
+            break;
+        }
+        written += (int) n;
+    }
+    vm->outputSize = 0;
+    vm->lastFlush = monotonicNs();
+}
+
+static inline void outputChar(struct lc3_vm *vm, char c) {
+    if (vm->outputSize == OUTPUT_BUFFER_SIZE) {
+        flushOutput(vm);
+    }
+    vm->outputBuffer[vm->outputSize++] = c;
+}
+
+static void outputString(struct lc3_vm *vm, const char *str) {
+    while (*str) {
+        outputChar(vm, *str++);
+    }
+}
+
+// called once at the end of every printing trap
+static inline void outputDone(struct lc3_vm *vm) {
+    if (vm->outputMode == OUTPUT_UNBUFFERED) {
+        flushOutput(vm);
+    }
+}
+
+static inline uint16_t readKey(struct lc3_vm *vm) {
+    return vm->replay ? replayRead(vm) : keyboardRead(&vm->keyboard);
+}
+
+// a guest run by the scheduler gives its worker back instead of waiting for input
+static int parkForInput(struct lc3_vm *vm) {
+    if (vm->outputSize) {
+        flushOutput(vm);
+    }
+    if (!vm->parkOnInput || keyboardReady(&vm->keyboard)) {
+        return 0;
+    }
+    vm->blocked = 1;
+    // the TRAP runs again once input is there
+    --vm->registers[R_PC];
+    return 1;
+}
+
+static uint16_t readKbsr(struct lc3_vm *vm) {
+    // plain loads while keys are pending or an input thread is attached
+    if (vm->replay ? replayReady(vm) : keyboardPending(&vm->keyboard) || keyboardReady(&vm->keyboard)) {
         return STATUS_BIT;
-    } else if (address == MR_DDR) {
+    }
+    // the guest is waiting for a key, so whatever it printed should be visible
+    if (vm->outputSize) {
+        flushOutput(vm);
+    }
+    return 0;
+}
+
+static uint16_t readKbdr(struct lc3_vm *vm) {
+    return readKbsr(vm) ? readKey(vm) : 0;
+}
+
+static uint16_t readDsr(struct lc3_vm *vm) {
+    (void) vm;
+    return STATUS_BIT;
+}
+
+static uint16_t readDdr(struct lc3_vm *vm) {
+    (void) vm;
+    return 0;
+}
+
+// console registers by their offset from MR_KBSR
+static uint16_t (*const consoleRegisters[MR_DDR - MR_KBSR + 1])(struct lc3_vm *vm) = {
+        [MR_KBSR - MR_KBSR] = readKbsr, [MR_KBDR - MR_KBSR] = readKbdr,
+        [MR_DSR - MR_KBSR] = readDsr, [MR_DDR - MR_KBSR] = readDdr,
+};
+
+// the console device every guest starts with, the words between its registers are plain memory
+static int consoleRead(void *data, uint16_t address, uint16_t *value) {
+    uint16_t (*reg)(struct lc3_vm *vm) = consoleRegisters[address - MR_KBSR];
+    if (!reg) {
         return 0;
     }
+    *value = reg(data);
+    return 1;
+}
 
-    return memory[address];
+uint16_t memoryRead(struct lc3_vm *vm, uint16_t address) {
+    uint16_t value;
+    if (deviceMapped(vm, address) && deviceRead(vm, address, &value)) {
+        return value;
+    }
+    return memoryPeek(vm, address);
 }
 
-void memoryWrite(uint16_t address, uint16_t value) {
-    memory[address] = value;
+void memoryWrite(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    if (deviceMapped(vm, address) && deviceWrite(vm, address, value)) {
+        return;
+    }
+    memoryPoke(vm, address, value);
+    forgetDecoded(vm, address);
+#ifdef YAVM_JIT
+    if (vm->jit && vm->jit->codeMap[address]) {
+        jitInvalidate(vm, address);
+    }
+#endif
 }
 
-void readImageFile(const char *path) {
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        printf("Wrong path");
-        exit(-1);
+void invalidateDecoded(struct lc3_vm *vm, uint16_t address, uint32_t count) {
+    if (count > 0x10000u - address) {
+        count = 0x10000u - address;
+    }
+    if (count && vm->decoded[(uint16_t) (address - 1)].handler > D_BR_SPIN) {
+        vm->decoded[(uint16_t) (address - 1)].handler = D_DECODE;
+    }
+    // only slots in use are written, the rest of the cache of a new guest stays untouched and takes no memory
+    for (uint32_t i = 0; i < count; ++i) {
+        if (vm->decoded[address + i].handler != D_DECODE) {
+            vm->decoded[address + i].handler = D_DECODE;
+        }
     }
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = toLittleEndian16(origin);
+}
 
-    uint16_t maxRead = UINT16_MAX - origin;
-    uint16_t *ptr = memory + origin;
-    uint32_t read = fread(ptr, sizeof(uint16_t), maxRead, file);
-    while (read-- > 0) {
-        *ptr = toLittleEndian16(*ptr);
-        ++ptr;
+static struct lc3_decoded decodePlain(struct lc3_vm *vm, uint16_t address, uint16_t instruction) {
+    struct lc3_decoded d = decode(instruction);
+    if (d.handler == D_BR && spinLoop(vm, address + 1 + d.imm, address, 0)) {
+        d.handler = D_BR_SPIN;
     }
-    fclose(file);
+    return d;
 }
 
-void emulate() {
-    const int startAddr = 0x3000;
-    registers[R_PC] = startAddr;
-    running = 1;
-    while (running) {
-        uint16_t instruction = memoryRead(registers[R_PC]++);
-        uint16_t op = instruction >> 12;
-        switch (op) {
-            case OP_ADD:
-                add(instruction);
-                break;
-            case OP_AND:
-                and(instruction);
-                break;
-            case OP_BR:
-                br(instruction);
-                break;
-            case OP_JMP:
-                jmp(instruction);
-                break;
-            case OP_JSR:
-                jsr(instruction);
-                break;
-            case OP_LD:
-                ld(instruction);
-                break;
-            case OP_LDI:
-                ldi(instruction);
-                break;
-            case OP_LDR:
-                ldr(instruction);
-                break;
-            case OP_LEA:
-                lea(instruction);
-                break;
-            case OP_NOT:
-                not(instruction);
-                break;
-            case OP_ST:
-                st(instruction);
-                break;
-            case OP_STI:
-                sti(instruction);
-                break;
-            case OP_STR:
-                str(instruction);
-                break;
-            case OP_TRAP:
-                trap(instruction);
+// the opcode pairs that run most often on the bundled images, found with the pair counts of the profiler
+static const struct {
+    uint8_t first;
+    uint8_t second;
+    uint8_t fused;
+} superinstructions[] = {
+        {D_ADD, D_BR, D_ADD_BR},
+        {D_ADD_IMM, D_BR, D_ADD_IMM_BR},
+        {D_ADD_IMM, D_ADD, D_ADD_IMM_ADD},
+        {D_LD, D_ADD, D_LD_ADD},
+        {D_LD, D_ADD_IMM, D_LD_ADD_IMM},
+        {D_AND_IMM, D_ADD_IMM, D_AND_IMM_ADD_IMM},
+};
+
+/*
+    Turns the freshly decoded instruction at `address` into a superinstruction if it starts one of the
+    pairs above, predecoding the second instruction as well. A superinstruction stays valid as long as
+    the slot after it does, forgetDecoded() and invalidateDecoded() drop both.
+*/
+static void fuseAt(struct lc3_vm *vm, uint16_t address) {
+    if (address == UINT16_MAX || deviceMapped(vm, address + 1)) {
+        return;
+    }
+    struct lc3_decoded *d = &vm->decoded[address];
+    struct lc3_decoded *next = &vm->decoded[address + 1];
+    for (size_t i = 0; i < sizeof(superinstructions) / sizeof(superinstructions[0]); ++i) {
+        if (superinstructions[i].first != d->handler) {
+            continue;
+        }
+        if (next->handler == D_DECODE) {
+            *next = decodePlain(vm, address + 1, memoryPeek(vm, address + 1));
+        }
+        if (superinstructions[i].second == firstHandler(next->handler)) {
+            d->handler = superinstructions[i].fused;
+            return;
         }
     }
+}
 
+/*
+    Slow path of the predecode cache, taken the first time an address is executed after a load or a
+    write to it. Device registers are never cached since fetching them has side effects.
+*/
+static const struct lc3_decoded *decodeAt(struct lc3_vm *vm, uint16_t address, struct lc3_decoded *scratch) {
+    uint16_t instruction = memoryRead(vm, address);
+    if (deviceMapped(vm, address)) {
+        *scratch = decode(instruction);
+        return scratch;
+    }
+    vm->decoded[address] = decodePlain(vm, address, instruction);
+    fuseAt(vm, address);
+    return &vm->decoded[address];
+}
 
+// executes a single predecoded instruction, PC already points past it. Of a superinstruction only the first.
+static inline void execute(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    switch (firstHandler(d->handler)) {
+        case D_ADD:
+            add(vm, d);
+            break;
+        case D_ADD_IMM:
+            addImm(vm, d);
+            break;
+        case D_AND:
+            and(vm, d);
+            break;
+        case D_AND_IMM:
+            andImm(vm, d);
+            break;
+        case D_BR:
+            br(vm, d);
+            break;
+        case D_BR_SPIN:
+            brSpin(vm, d);
+            break;
+        case D_JMP:
+            jmp(vm, d);
+            break;
+        case D_JSR:
+            jsr(vm, d);
+            break;
+        case D_JSRR:
+            jsrr(vm, d);
+            break;
+        case D_LD:
+            ld(vm, d);
+            break;
+        case D_LDI:
+            ldi(vm, d);
+            break;
+        case D_LDR:
+            ldr(vm, d);
+            break;
+        case D_LEA:
+            lea(vm, d);
+            break;
+        case D_NOT:
+            not(vm, d);
+            break;
+        case D_ST:
+            st(vm, d);
+            break;
+        case D_STI:
+            sti(vm, d);
+            break;
+        case D_STR:
+            str(vm, d);
+            break;
+        case D_TRAP:
+            trap(vm, d);
+    }
 }
 
-void updateFlags(uint16_t reg) {
-    if (registers[reg] == 0) {
-        registers[R_COND] = FL_ZR;
-    } else if ((registers[reg] >> 15) & 0x1) {
-        registers[R_COND] = FL_NEG;
-    } else {
-        registers[R_COND] = FL_POS;
+#if defined(YAVM_THREADED_DISPATCH) && defined(YAVM_PINNED_REGISTERS) && defined(__GNUC__)
+
+/*
+    Direct-threaded dispatch with the guest registers pinned: PC, COND and R0-R7 live in locals of the loop
+    instead of vm->registers. PC and COND stay in host registers, and stores to R0-R7 cannot alias anything
+    read through `vm`, so nothing has to be reloaded after them. The locals are written back before the
+    code that looks at vm->registers runs - TRAP, spin loops, decoding, loads and stores on device pages -
+    and when the slice ends. Debugging and profiling take instrumentedLoop(), which is not pinned.
+
+    Superinstructions run both their instructions in one dispatch, each still counted against the budget.
+*/
+static uint64_t dispatchLoop(struct lc3_vm *vm, uint64_t budget) {
+    static void *const handlers[D_COUNT] = {
+            [D_DECODE] = &&op_decode,
+            [D_ADD] = &&op_add,
+            [D_ADD_IMM] = &&op_add_imm,
+            [D_AND] = &&op_and,
+            [D_AND_IMM] = &&op_and_imm,
+            [D_BR] = &&op_br,
+            [D_JMP] = &&op_jmp,
+            [D_JSR] = &&op_jsr,
+            [D_JSRR] = &&op_jsrr,
+            [D_LD] = &&op_ld,
+            [D_LDI] = &&op_ldi,
+            [D_LDR] = &&op_ldr,
+            [D_LEA] = &&op_lea,
+            [D_NOT] = &&op_not,
+            [D_ST] = &&op_st,
+            [D_STI] = &&op_sti,
+            [D_STR] = &&op_str,
+            [D_TRAP] = &&op_trap,
+            [D_NOP] = &&op_nop,
+            [D_BR_SPIN] = &&op_br_spin,
+            [D_ADD_BR] = &&op_add_br,
+            [D_ADD_IMM_BR] = &&op_add_imm_br,
+            [D_ADD_IMM_ADD] = &&op_add_imm_add,
+            [D_LD_ADD] = &&op_ld_add,
+            [D_LD_ADD_IMM] = &&op_ld_add_imm,
+            [D_AND_IMM_ADD_IMM] = &&op_and_imm_add_imm,
+    };
+    uint64_t remaining = budget;
+    const struct lc3_decoded *d;
+    struct lc3_decoded scratch;
+    uint16_t r[R_R7 + 1];
+    uint16_t pc = vm->registers[R_PC];
+    uint16_t cond = vm->registers[R_COND];
+    uint16_t address;
+    uint16_t value;
+    memcpy(r, vm->registers, sizeof(r));
+
+#define SPILL() do {                                    \
+        memcpy(vm->registers, r, sizeof(r));            \
+        vm->registers[R_PC] = pc;                       \
+        vm->registers[R_COND] = cond;                   \
+    } while (0)
+
+#define RELOAD() do {                                   \
+        memcpy(r, vm->registers, sizeof(r));            \
+        pc = vm->registers[R_PC];                       \
+        cond = vm->registers[R_COND];                   \
+    } while (0)
+
+// device callbacks may look at or change the registers of their guest
+#define LOAD(at) do {                                   \
+        address = (at);                                 \
+        if (__builtin_expect(deviceMapped(vm, address), 0)) { \
+            SPILL();                                    \
+            value = memoryRead(vm, address);            \
+            RELOAD();                                   \
+        } else {                                        \
+            value = memoryPeek(vm, address);            \
+        }                                               \
+    } while (0)
+
+#define STORE(at, v) do {                               \
+        address = (at);                                 \
+        value = (v);                                    \
+        if (__builtin_expect(deviceMapped(vm, address), 0)) { \
+            SPILL();                                    \
+            memoryWrite(vm, address, value);            \
+            RELOAD();                                   \
+        } else {                                        \
+            memoryWrite(vm, address, value);            \
+        }                                               \
+    } while (0)
+
+// moves on to the next instruction, the second half of a superinstruction is already decoded
+#define NEXT() do {                                     \
+        if (__builtin_expect(remaining == 0, 0)) {      \
+            goto out;                                   \
+        }                                               \
+        --remaining;                                    \
+        d = &vm->decoded[pc++];                         \
+    } while (0)
+
+#define DISPATCH() do {                                 \
+        NEXT();                                         \
+        goto *handlers[d->handler];                     \
+    } while (0)
+
+    DISPATCH();
+
+    op_decode:
+    SPILL();
+    d = decodeAt(vm, pc - 1, &scratch);
+    RELOAD();
+    goto *handlers[d->handler];
+    op_add:
+    r[d->dr] = cond = r[d->sr1] + r[d->sr2];
+    DISPATCH();
+    op_add_imm:
+    r[d->dr] = cond = r[d->sr1] + d->imm;
+    DISPATCH();
+    op_and:
+    r[d->dr] = cond = r[d->sr1] & r[d->sr2];
+    DISPATCH();
+    op_and_imm:
+    r[d->dr] = cond = r[d->sr1] & d->imm;
+    DISPATCH();
+    op_br:
+    if (d->dr & conditionFlags(cond)) {
+        pc += d->imm;
+    }
+    DISPATCH();
+    op_br_spin:
+    SPILL();
+    brSpin(vm, d);
+    RELOAD();
+    if (!vm->running || vm->blocked) {
+        goto out;
+    }
+    DISPATCH();
+    op_jmp:
+    pc = r[d->sr1];
+    DISPATCH();
+    op_jsr:
+    r[R_R7] = pc;
+    pc += d->imm;
+    DISPATCH();
+    op_jsrr:
+    // read BaseR before R7 is overwritten, JSRR R7 jumps to the old R7
+    address = r[d->sr1];
+    r[R_R7] = pc;
+    pc = address;
+    DISPATCH();
+    op_ld:
+    LOAD(pc + d->imm);
+    r[d->dr] = cond = value;
+    DISPATCH();
+    op_ldi:
+    LOAD(pc + d->imm);
+    LOAD(value);
+    r[d->dr] = cond = value;
+    DISPATCH();
+    op_ldr:
+    LOAD(r[d->sr1] + d->imm);
+    r[d->dr] = cond = value;
+    DISPATCH();
+    op_lea:
+    r[d->dr] = cond = pc + d->imm;
+    DISPATCH();
+    op_not:
+    r[d->dr] = cond = ~r[d->sr1];
+    DISPATCH();
+    op_st:
+    STORE(pc + d->imm, r[d->dr]);
+    DISPATCH();
+    op_sti:
+    LOAD(pc + d->imm);
+    STORE(value, r[d->dr]);
+    DISPATCH();
+    op_str:
+    STORE(r[d->sr1] + d->imm, r[d->dr]);
+    DISPATCH();
+    op_nop:
+    DISPATCH();
+    op_trap:
+    SPILL();
+    trap(vm, d);
+    RELOAD();
+    if (!vm->running || vm->blocked) {
+        goto out;
+    }
+    DISPATCH();
+    op_add_br:
+    r[d->dr] = cond = r[d->sr1] + r[d->sr2];
+    NEXT();
+    if (d->dr & conditionFlags(cond)) {
+        pc += d->imm;
+    }
+    DISPATCH();
+    op_add_imm_br:
+    r[d->dr] = cond = r[d->sr1] + d->imm;
+    NEXT();
+    if (d->dr & conditionFlags(cond)) {
+        pc += d->imm;
+    }
+    DISPATCH();
+    op_add_imm_add:
+    r[d->dr] = cond = r[d->sr1] + d->imm;
+    NEXT();
+    r[d->dr] = cond = r[d->sr1] + r[d->sr2];
+    DISPATCH();
+    op_ld_add:
+    LOAD(pc + d->imm);
+    r[d->dr] = cond = value;
+    NEXT();
+    // a device callback may have written the second instruction
+    if (__builtin_expect(d->handler == D_DECODE, 0)) {
+        goto op_decode;
     }
+    r[d->dr] = cond = r[d->sr1] + r[d->sr2];
+    DISPATCH();
+    op_ld_add_imm:
+    LOAD(pc + d->imm);
+    r[d->dr] = cond = value;
+    NEXT();
+    if (__builtin_expect(d->handler == D_DECODE, 0)) {
+        goto op_decode;
+    }
+    r[d->dr] = cond = r[d->sr1] + d->imm;
+    DISPATCH();
+    op_and_imm_add_imm:
+    r[d->dr] = cond = r[d->sr1] & d->imm;
+    NEXT();
+    r[d->dr] = cond = r[d->sr1] + d->imm;
+    DISPATCH();
+
+    out:
+    SPILL();
+    return budget - remaining;
+
+#undef DISPATCH
+#undef NEXT
+#undef STORE
+#undef LOAD
+#undef RELOAD
+#undef SPILL
 }
 
-//Add instruction
+#elif defined(YAVM_THREADED_DISPATCH) && defined(__GNUC__)
+
 /*
-    Two cases:
-    First:
-        ===========================================================
-        |0xF...0xC| 0xB...0x9|0x8...0x6|  0x5 |0x4...0x3|0x2...0x0|
-        |   0001  |    DR    |   SR1   |   0  |    00   |  SR2    |
-        ===========================================================
-   Second:
-        =================================================
-        |0xF...0xC| 0xB...0x9|0x8...0x6|  0x5 |0x4...0x0|
-        |   0001  |    DR    |   SR1   |   1  |    imm5 |
-        =================================================
+    Direct-threaded dispatch: every handler fetches the next instruction and jumps straight to its label
+    through a computed goto. Each opcode ends in its own indirect jump, which gives the branch predictor
+    one history slot per opcode instead of a single shared one for the whole switch. Only TRAP and the BR
+    of a spin loop can clear `running` or block the guest, so those are checked there and nowhere else; the
+    budget is a single count-down per instruction.
 */
-void add(uint16_t instruction) {
-    uint16_t dr = (instruction >> 9) & 0x7;
-    uint16_t sr1 = (instruction >> 6) & 0x7;
-
-    //Checking imm flag
-    if ((instruction >> 5) & 0x1) {
-        uint16_t imm = signExtend(instruction & 0x1F, 5);
-        registers[dr] = registers[sr1] + imm;
-    } else {
-        uint16_t sr2 = instruction & 0x7;
-        registers[dr] = registers[sr1] + registers[sr2];
+static uint64_t dispatchLoop(struct lc3_vm *vm, uint64_t budget) {
+    static void *const handlers[D_COUNT] = {
+            [D_DECODE] = &&op_decode,
+            [D_ADD] = &&op_add,
+            [D_ADD_IMM] = &&op_add_imm,
+            [D_AND] = &&op_and,
+            [D_AND_IMM] = &&op_and_imm,
+            [D_BR] = &&op_br,
+            [D_JMP] = &&op_jmp,
+            [D_JSR] = &&op_jsr,
+            [D_JSRR] = &&op_jsrr,
+            [D_LD] = &&op_ld,
+            [D_LDI] = &&op_ldi,
+            [D_LDR] = &&op_ldr,
+            [D_LEA] = &&op_lea,
+            [D_NOT] = &&op_not,
+            [D_ST] = &&op_st,
+            [D_STI] = &&op_sti,
+            [D_STR] = &&op_str,
+            [D_TRAP] = &&op_trap,
+            [D_NOP] = &&op_nop,
+            [D_BR_SPIN] = &&op_br_spin,
+            // superinstructions run their first instruction
+            [D_ADD_BR] = &&op_add,
+            [D_ADD_IMM_BR] = &&op_add_imm,
+            [D_ADD_IMM_ADD] = &&op_add_imm,
+            [D_LD_ADD] = &&op_ld,
+            [D_LD_ADD_IMM] = &&op_ld,
+            [D_AND_IMM_ADD_IMM] = &&op_and_imm,
+    };
+    uint64_t remaining = budget;
+    const struct lc3_decoded *d;
+    struct lc3_decoded scratch;
+
+#define DISPATCH() do {                                 \
+        if (__builtin_expect(remaining == 0, 0)) {      \
+            goto out;                                   \
+        }                                               \
+        --remaining;                                    \
+        d = &vm->decoded[vm->registers[R_PC]++];        \
+        goto *handlers[d->handler];                     \
+    } while (0)
+
+    DISPATCH();
+
+    op_decode:
+    d = decodeAt(vm, vm->registers[R_PC] - 1, &scratch);
+    goto *handlers[d->handler];
+    op_add:
+    add(vm, d);
+    DISPATCH();
+    op_add_imm:
+    addImm(vm, d);
+    DISPATCH();
+    op_and:
+    and(vm, d);
+    DISPATCH();
+    op_and_imm:
+    andImm(vm, d);
+    DISPATCH();
+    op_br:
+    br(vm, d);
+    DISPATCH();
+    op_br_spin:
+    brSpin(vm, d);
+    if (!vm->running || vm->blocked) {
+        goto out;
+    }
+    DISPATCH();
+    op_jmp:
+    jmp(vm, d);
+    DISPATCH();
+    op_jsr:
+    jsr(vm, d);
+    DISPATCH();
+    op_jsrr:
+    jsrr(vm, d);
+    DISPATCH();
+    op_ld:
+    ld(vm, d);
+    DISPATCH();
+    op_ldi:
+    ldi(vm, d);
+    DISPATCH();
+    op_ldr:
+    ldr(vm, d);
+    DISPATCH();
+    op_lea:
+    lea(vm, d);
+    DISPATCH();
+    op_not:
+    not(vm, d);
+    DISPATCH();
+    op_st:
+    st(vm, d);
+    DISPATCH();
+    op_sti:
+    sti(vm, d);
+    DISPATCH();
+    op_str:
+    str(vm, d);
+    DISPATCH();
+    op_nop:
+    DISPATCH();
+    op_trap:
+    trap(vm, d);
+    if (!vm->running || vm->blocked) {
+        goto out;
     }
-    updateFlags(dr);
+    DISPATCH();
+
+#undef DISPATCH
+
+    out:
+    return budget - remaining;
 }
 
+#else
 
-void ld(uint16_t instruction) {
-    uint16_t dr = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = signExtend(instruction & 0x1FF, 9);
-    registers[dr] = memoryRead(registers[R_PC] + pcOffset);
-    updateFlags(dr);
+// Portable fallback for compilers without the labels-as-values extension
+static uint64_t dispatchLoop(struct lc3_vm *vm, uint64_t budget) {
+    uint64_t count = 0;
+    struct lc3_decoded scratch;
+    while (vm->running && !vm->blocked && count < budget) {
+        uint16_t pc = vm->registers[R_PC]++;
+        const struct lc3_decoded *d = &vm->decoded[pc];
+        if (d->handler == D_DECODE) {
+            d = decodeAt(vm, pc, &scratch);
+        }
+        ++count;
+        execute(vm, d);
+    }
+    return count;
 }
 
-void ldi(uint16_t instruction) {
-    uint16_t dr = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = signExtend(instruction & 0x1FF, 9);
-    registers[dr] = memoryRead(memoryRead(registers[R_PC] + pcOffset));
+#endif
+
+void startVm(struct lc3_vm *vm) {
+    const int startAddr = 0x3000;
+    vm->registers[R_PC] = startAddr;
+    vm->registers[R_COND] = conditionResult(FL_ZR);
+    vm->running = 1;
+    vm->instructionCount = 0;
+    vm->stopReason = STOP_NONE;
+    vm->spinSince = 0;
+    vm->lastFlush = monotonicNs();
+    vm->deadline = vm->timeLimit ? vm->lastFlush + vm->timeLimit : 0;
 }
 
-void ldr(uint16_t instruction) {
-    uint16_t dr = (instruction >> 9) & 0x7;
-    uint16_t baseR = (instruction >> 6) & 0x7;
-    uint16_t pcOffset = signExtend(instruction & 0x3F, 6);
-    registers[dr] = memoryRead(registers[baseR] + pcOffset);
-    updateFlags(dr);
+void stopVm(struct lc3_vm *vm, int reason) {
+    vm->running = 0;
+    vm->stopReason = reason;
+    flushOutput(vm);
 }
 
-void st(uint16_t instruction) {
-    uint16_t sr = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = signExtend(instruction & 0x1FF, 9);
-    memoryWrite(registers[R_PC] + pcOffset, registers[sr]);
+#ifdef YAVM_JIT
+
+/*
+    Translated blocks account for all their instructions on entry and are only entered while they fit into
+    the budget. The last few instructions of a slice, fewer than the longest block, are interpreted, so a
+    slice ends exactly at its budget like in the other loops.
+*/
+static uint64_t jitLoop(struct lc3_vm *vm, uint64_t budget) {
+    uint64_t counter[2] = {0, budget};
+    uint8_t *exitSite = NULL;
+    struct lc3_decoded scratch;
+    while (vm->running && !vm->blocked && counter[0] < budget) {
+        void *block = budget - counter[0] >= JIT_MAX_BLOCK_LENGTH ? jitBlock(vm, vm->registers[R_PC], exitSite) : NULL;
+        if (block) {
+            exitSite = jitEnter(vm, block, counter);
+            continue;
+        }
+        // traps, spin loops, code on device pages and the end of a slice are interpreted
+        exitSite = NULL;
+        uint16_t pc = vm->registers[R_PC]++;
+        const struct lc3_decoded *d = &vm->decoded[pc];
+        if (d->handler == D_DECODE) {
+            d = decodeAt(vm, pc, &scratch);
+        }
+        ++counter[0];
+        execute(vm, d);
+    }
+    return counter[0];
 }
 
-void sti(uint16_t instruction) {
-    uint16_t sr = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = signExtend(instruction & 0x1FF, 9);
-    memoryWrite(memoryRead(registers[R_PC] + pcOffset), registers[sr]);
+#endif
+
+static int breaksAt(struct lc3_vm *vm, uint16_t pc, const struct lc3_decoded *d) {
+    return pc == vm->breakPc ||
+           (d->handler == D_TRAP && (vm->breakTrap == BREAK_ANY_TRAP || vm->breakTrap == d->imm)) ||
+           (vm->debug && vm->debug->breakpoint[pc]);
 }
 
-// 0x0000 0000 0011 1111
-void str(uint16_t instruction) {
-    uint16_t sr = (instruction >> 9) & 0x7;
-    uint16_t baseR = (instruction >> 6) & 0x7;
-    uint16_t pcOffset6 = signExtend(instruction & 0x3F, 6);
-    memoryWrite(registers[baseR] + pcOffset6, registers[sr]);
+// the address a store is about to write, PC already points past it. -1 if finding out would touch a device.
+static int32_t storeAddress(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    switch (d->handler) {
+        case D_ST:
+            return (uint16_t) (vm->registers[R_PC] + d->imm);
+        case D_STR:
+            return (uint16_t) (vm->registers[d->sr1] + d->imm);
+        case D_STI: {
+            uint16_t pointer = vm->registers[R_PC] + d->imm;
+            return deviceMapped(vm, pointer) ? -1 : memoryPeek(vm, pointer);
+        }
+        default:
+            return -1;
+    }
 }
 
-void lea(uint16_t instruction) {
-    uint16_t dr = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = signExtend(instruction & 0x1FF, 9);
-    registers[dr] = registers[R_PC] + pcOffset;
-    updateFlags(dr);
+/*
+    dispatchLoop() for guests with a profile, an input log, a break condition or watchpoints. vm->instructionCount is
+    exact while an instruction runs (it counts the instructions retired before it), which record/replay
+    keys input on.
+*/
+static uint64_t instrumentedLoop(struct lc3_vm *vm, uint64_t budget) {
+    struct lc3_profile *profile = vm->profile;
+    struct lc3_debug *debug = vm->debug && vm->debug->watchCount ? vm->debug : NULL;
+    uint64_t base = vm->instructionCount;
+    uint64_t count = 0;
+    struct lc3_decoded scratch;
+    while (vm->running && !vm->blocked && count < budget) {
+        uint16_t pc = vm->registers[R_PC];
+        const struct lc3_decoded *d = &vm->decoded[pc];
+        if (d->handler == D_DECODE) {
+            d = decodeAt(vm, pc, &scratch);
+        }
+        if (!vm->atBreak && breaksAt(vm, pc, d)) {
+            vm->atBreak = 1;
+            break;
+        }
+        vm->atBreak = 0;
+        ++vm->registers[R_PC];
+        vm->instructionCount = base + count;
+        ++count;
+        int32_t watched = debug ? storeAddress(vm, d) : -1;
+        if (watched >= 0 && !debugWatched(debug, (uint16_t) watched)) {
+            watched = -1;
+        }
+        uint16_t old = watched >= 0 ? memoryPeek(vm, (uint16_t) watched) : 0;
+        execute(vm, d);
+        if (profile && !vm->blocked) {
+            profileCount(profile, pc, firstHandler(d->handler));
+            profileControl(profile, vm->registers[R_PC], d);
+        }
+        if (watched >= 0) {
+            debug->watchHit = 1;
+            debug->hitAddress = (uint16_t) watched;
+            debug->oldValue = old;
+            debug->newValue = memoryPeek(vm, (uint16_t) watched);
+            break;
+        }
+    }
+    // runVm() adds the slice
+    vm->instructionCount = base;
+    return count;
 }
 
-void and(uint16_t instruction) {
-    uint16_t dr = (instruction >> 9) & 0x7;
-    uint16_t sr1 = (instruction >> 6) & 0x7;
-    if ((instruction >> 5) & 0x1) {
-        uint16_t imm = signExtend(instruction & 0x1F, 5);
-        registers[dr] = registers[sr1] & imm;
+int runVm(struct lc3_vm *vm, uint64_t budget) {
+    vm->blocked = 0;
+    if (vm->instructionLimit) {
+        uint64_t left = vm->instructionLimit > vm->instructionCount ? vm->instructionLimit - vm->instructionCount : 0;
+        budget = left < budget ? left : budget;
+    }
+    if (vm->debug) {
+        vm->debug->watchHit = 0;
+    }
+    uint64_t executed;
+    if (vm->profile || vm->replay || vm->breakPc >= 0 || vm->breakTrap >= 0 || debugActive(vm->debug)) {
+        executed = instrumentedLoop(vm, budget);
     } else {
-        uint16_t sr2 = instruction & 0x7;
-        registers[dr] = registers[sr1] & registers[sr2];
+        vm->atBreak = 0;
+#ifdef YAVM_JIT
+        executed = vm->jit ? jitLoop(vm, budget) : dispatchLoop(vm, budget);
+#else
+        executed = dispatchLoop(vm, budget);
+#endif
+    }
+    if (vm->blocked) {
+        // the parked TRAP or BR did not retire, it is counted when it runs again
+        --executed;
+    }
+    vm->instructionCount += executed;
+
+    if (vm->outputSize && vm->flushInterval && monotonicNs() - vm->lastFlush >= vm->flushInterval) {
+        flushOutput(vm);
+    }
+    if (vm->running) {
+        if (vm->instructionLimit && vm->instructionCount >= vm->instructionLimit) {
+            stopVm(vm, STOP_INSTRUCTIONS);
+            return VM_STOPPED;
+        }
+        if (vm->deadline && monotonicNs() >= vm->deadline) {
+            stopVm(vm, STOP_TIMEOUT);
+            return VM_STOPPED;
+        }
+    }
+    if (vm->stopReason) {
+        return VM_STOPPED;
+    }
+    if (!vm->running) {
+        return VM_HALTED;
+    }
+    if (vm->blocked) {
+        return VM_BLOCKED;
+    }
+    return vm->atBreak || (vm->debug && vm->debug->watchHit) ? VM_BREAK : VM_BUDGET;
+}
+
+#define EMULATE_SLICE (1u << 20)
+
+uint64_t emulate(struct lc3_vm *vm) {
+    startVm(vm);
+    // slices only give the output flush interval and the time limit a chance to run
+    while (runVm(vm, EMULATE_SLICE) == VM_BUDGET) {
     }
+    return vm->instructionCount;
 }
 
-void not(uint16_t instruction) {
-    uint16_t dr = (instruction >> 9) & 0x7;
-    uint16_t sr = (instruction >> 6) & 0x7;
-    registers[dr] = ~registers[sr];
-    updateFlags(dr);
+void updateFlags(struct lc3_vm *vm, uint16_t reg) {
+    vm->registers[R_COND] = vm->registers[reg];
 }
 
-void br(uint16_t instruction) {
-    uint16_t negBit = (instruction >> 0xB) & 0x1;
-    uint16_t zeroBit = (instruction >> 0xA) & 0x1;
-    uint16_t posBit = (instruction >> 0x9) & 0x1;
-    uint16_t pcOffset = signExtend(instruction & 0x1FF, 9);
+void add(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = vm->registers[d->sr1] + vm->registers[d->sr2];
+    updateFlags(vm, d->dr);
+}
+
+void addImm(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = vm->registers[d->sr1] + d->imm;
+    updateFlags(vm, d->dr);
+}
+
+void ld(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = memoryRead(vm, vm->registers[R_PC] + d->imm);
+    updateFlags(vm, d->dr);
+}
+
+void ldi(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = memoryRead(vm, memoryRead(vm, vm->registers[R_PC] + d->imm));
+    updateFlags(vm, d->dr);
+}
+
+void ldr(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = memoryRead(vm, vm->registers[d->sr1] + d->imm);
+    updateFlags(vm, d->dr);
+}
+
+void st(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    memoryWrite(vm, vm->registers[R_PC] + d->imm, vm->registers[d->dr]);
+}
+
+void sti(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    memoryWrite(vm, memoryRead(vm, vm->registers[R_PC] + d->imm), vm->registers[d->dr]);
+}
+
+void str(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    memoryWrite(vm, vm->registers[d->sr1] + d->imm, vm->registers[d->dr]);
+}
+
+void lea(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = vm->registers[R_PC] + d->imm;
+    updateFlags(vm, d->dr);
+}
+
+void and(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = vm->registers[d->sr1] & vm->registers[d->sr2];
+    updateFlags(vm, d->dr);
+}
+
+void andImm(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = vm->registers[d->sr1] & d->imm;
+    updateFlags(vm, d->dr);
+}
+
+void not(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[d->dr] = ~vm->registers[d->sr1];
+    updateFlags(vm, d->dr);
+}
+
+void br(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    // n, z and p sit in the DR field and line up with FL_NEG, FL_ZR and FL_POS
+    if (d->dr & conditionFlags(vm->registers[R_COND])) {
+        vm->registers[R_PC] += d->imm;
+    }
+}
+
+#define SPIN_MAX_LENGTH 4
+// host time one round of a spin loop stands for, see advanceCounters()
+#define SPIN_ROUND_NS 10
+
+/*
+    A spin loop polls KBSR and changes nothing else: up to SPIN_MAX_LENGTH loads, the last of them reading
+    KBSR, closed by a BR back to the first one that is taken while KBSR reads as not ready. None of the loads
+    reads a register another one writes, so every round computes the same registers and flags until a key
+    arrives. Other loads must hit plain memory, device reads could have side effects.
 
-    if (negBit | zeroBit | posBit) {
-        registers[R_PC] += pcOffset;
+    The one exception are counters, ADD Rn, Rn, #imm of a register nothing else in the loop touches. Games
+    count rounds like that to seed their random numbers from the time to the next key press.
+*/
+int spinLoop(struct lc3_vm *vm, uint16_t target, uint16_t branch, int resolve) {
+    struct lc3_decoded b = decode(memoryPeek(vm, branch));
+    if (b.handler != D_BR || !(b.dr & FL_ZR) || target >= branch || branch - target > SPIN_MAX_LENGTH ||
+        deviceMapped(vm, branch)) {
+        return 0;
+    }
+    uint8_t written = 0;
+    uint8_t read = 0;
+    uint8_t counters = 0;
+    for (uint16_t pc = target; pc < branch; ++pc) {
+        struct lc3_decoded d = decode(memoryPeek(vm, pc));
+        uint16_t next = pc + 1;
+        int last = pc + 1 == branch;
+        int known = 1;
+        uint16_t address;
+        switch (d.handler) {
+            case D_ADD_IMM:
+                if (d.dr != d.sr1 || (counters & 1 << d.dr) || last) {
+                    return 0;
+                }
+                counters |= 1 << d.dr;
+                continue;
+            case D_LD:
+                address = next + d.imm;
+                break;
+            case D_LDI:
+                if (deviceMapped(vm, next + d.imm)) {
+                    return 0;
+                }
+                address = memoryPeek(vm, next + d.imm);
+                break;
+            case D_LDR:
+                read |= 1 << d.sr1;
+                known = resolve;
+                address = vm->registers[d.sr1] + d.imm;
+                break;
+            case D_LEA:
+                if (last) {
+                    return 0;
+                }
+                known = 0;
+                address = 0;
+                break;
+            default:
+                return 0;
+        }
+        written |= 1 << d.dr;
+        if (known && (last ? address != MR_KBSR : deviceMapped(vm, address))) {
+            return 0;
+        }
     }
+    return !(written & read) && !(counters & (written | read));
 }
 
-void jmp(uint16_t instruction) {
-    uint16_t baseR = (instruction >> 6) >> 0x7;
-    registers[R_PC] = registers[baseR];
+// moves the counters of a spin loop on as if it had kept running for `ns`
+static void advanceCounters(struct lc3_vm *vm, uint16_t target, uint16_t branch, uint64_t ns) {
+    uint64_t rounds = ns / SPIN_ROUND_NS;
+    for (uint16_t pc = target; pc < branch; ++pc) {
+        struct lc3_decoded d = decode(memoryPeek(vm, pc));
+        if (d.handler == D_ADD_IMM) {
+            vm->registers[d.dr] += (uint16_t) (rounds * d.imm);
+        }
+    }
 }
 
-void jsr(uint16_t instruction) {
-    uint16_t eleventhBit = (instruction >> 0xB) & 0x1;
-    registers[R_R7] = registers[R_PC];
-    if (eleventhBit) {
-        uint16_t pcOffset = signExtend(instruction & 0x7FF, 11);
-        registers[R_PC] += pcOffset;
-    } else {
-        uint16_t baseR = (instruction >> 6) & 0x7;
-        registers[R_PC] = registers[baseR];
+// a spin loop found by decodeAt(), the guest waits for input instead of running it
+void brSpin(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    if (!(d->dr & conditionFlags(vm->registers[R_COND]))) {
+        return;
     }
+    uint16_t branch = vm->registers[R_PC] - 1;
+    uint16_t target = branch + 1 + d->imm;
+    vm->registers[R_PC] = target;
+    // the log decides when input shows up in a replay, and the loop may have been overwritten since decoding
+    if (vm->replay || !spinLoop(vm, target, branch, 1)) {
+        return;
+    }
+    if (keyboardReady(&vm->keyboard)) {
+        // back from parking
+        if (vm->spinSince) {
+            advanceCounters(vm, target, branch, monotonicNs() - vm->spinSince);
+            vm->spinSince = 0;
+        }
+        return;
+    }
+    if (vm->parkOnInput) {
+        vm->blocked = 1;
+        vm->spinSince = monotonicNs();
+        // the BR runs again once input is there
+        vm->registers[R_PC] = branch;
+        return;
+    }
+    uint64_t start = monotonicNs();
+    keyboardWait(&vm->keyboard, vm->deadline);
+    uint64_t now = monotonicNs();
+    advanceCounters(vm, target, branch, now - start);
+    // with nothing left to wait for the guest would spin on until the end of the slice
+    if (vm->deadline && now >= vm->deadline && !keyboardPending(&vm->keyboard)) {
+        stopVm(vm, STOP_TIMEOUT);
+    }
+}
+
+void jmp(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[R_PC] = vm->registers[d->sr1];
 }
 
-void trap(uint16_t instruction) {
-    switch (instruction & 0xFF) {
+void jsr(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    vm->registers[R_R7] = vm->registers[R_PC];
+    vm->registers[R_PC] += d->imm;
+}
+
+void jsrr(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    // read BaseR before R7 is overwritten, JSRR R7 jumps to the old R7
+    uint16_t target = vm->registers[d->sr1];
+    vm->registers[R_R7] = vm->registers[R_PC];
+    vm->registers[R_PC] = target;
+}
+
+void trap(struct lc3_vm *vm, const struct lc3_decoded *d) {
+    if (vm->trapHook && vm->trapHook(vm->trapData, vm, d->imm)) {
+        return;
+    }
+    switch (d->imm) {
         case TRAP_GETC:
-            trapGetc();
+            trapGetc(vm);
             break;
         case TRAP_IN:
-            trapIn();
+            trapIn(vm);
             break;
         case TRAP_OUT:
-            trapOut();
+            trapOut(vm);
             break;
         case TRAP_PUTSP:
-            trapPutsp();
+            trapPutsp(vm);
             break;
         case TRAP_PUTS:
-            trapPuts();
+            trapPuts(vm);
             break;
         case TRAP_HALT:
-            trapHalt();
+            trapHalt(vm);
             break;
     }
 }
@@ -314,47 +1147,55 @@ uint16_t zeroExtend(uint16_t x, int bit_count) {
     return x;
 }
 
-void trapPuts() {
-    uint16_t *ptr = memory + registers[R_R0];
-    while (*ptr) {
-        fputc((char) *ptr, stdout);
-        ptr++;
+void trapPuts(struct lc3_vm *vm) {
+    uint16_t address = vm->registers[R_R0];
+    uint16_t c;
+    while ((c = memoryPeek(vm, address++))) {
+        outputChar(vm, (char) c);
     }
-    fflush(stdout);
+    outputDone(vm);
 }
 
-void trapGetc() {
-    registers[R_R0] = (uint16_t) getchar();
+void trapGetc(struct lc3_vm *vm) {
+    if (parkForInput(vm)) {
+        return;
+    }
+    vm->registers[R_R0] = readKey(vm);
 }
 
-void trapOut() {
-    fputc((char) registers[R_R0], stdout);
-    fflush(stdout);
+void trapOut(struct lc3_vm *vm) {
+    outputChar(vm, (char) vm->registers[R_R0]);
+    outputDone(vm);
 }
 
-void trapIn() {
-    printf("Type in a character");
-    char c = (char) getchar();
-    fputc(c, stdout);
-    fflush(stdout);
+void trapIn(struct lc3_vm *vm) {
+    if (parkForInput(vm)) {
+        return;
+    }
+    outputString(vm, "Type in a character");
+    flushOutput(vm);
+    char c = (char) readKey(vm);
+    outputChar(vm, c);
+    outputDone(vm);
+    vm->registers[R_R0] = (uint16_t) c;
 }
 
-void trapPutsp() {
-    uint16_t *ptr = memory + registers[R_R0];
+void trapPutsp(struct lc3_vm *vm) {
+    uint16_t address = vm->registers[R_R0];
+    uint16_t word;
 
-    while (*ptr) {
-        char c1 = *ptr & 0xFF;
-        fputc(c1, stdout);
-        char c2 = *ptr >> 8;
-        if (c2) fputc(c2, stdout);
-        ++ptr;
+    while ((word = memoryPeek(vm, address++))) {
+        char c1 = word & 0xFF;
+        outputChar(vm, c1);
+        char c2 = word >> 8;
+        if (c2) outputChar(vm, c2);
     }
-    fflush(stdout);
+    outputDone(vm);
 }
 
-void trapHalt() {
-    puts("Halting...");
-    fflush(stdout);
-    running = 0;
+void trapHalt(struct lc3_vm *vm) {
+    outputString(vm, "Halting...\n");
+    flushOutput(vm);
+    vm->running = 0;
 }
 
@@ -7,10 +7,13 @@
 #include <unistd.h>
 #include <termios.h>
 #include <signal.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <time.h>
 
-#define assert_zero_extend(X, BIT_COUNT, EXPECTED) assert((EXPECTED) == zero_extend((X), (BIT_COUNT)))
+#include "keyboard.h"
 
-static int running;
+#define assert_zero_extend(X, BIT_COUNT, EXPECTED) assert((EXPECTED) == zero_extend((X), (BIT_COUNT)))
 
 enum {
     MR_KBSR = 0xFE00,
@@ -31,9 +34,9 @@ enum {
 };
 
 enum {
-    FL_POS = 0,
-    FL_ZR,
-    FL_NEG
+    FL_POS = 1 << 0,
+    FL_ZR  = 1 << 1,
+    FL_NEG = 1 << 2,
 };
 
 enum {
@@ -46,7 +49,7 @@ enum {
     R_R6,
     R_R7,
     R_PC,
-    R_COND,
+    R_COND, // the last value that set the condition codes, see conditionFlags()
     R_COUNT
 };
 
@@ -69,66 +72,328 @@ enum {
     OP_TRAP    // trap
 };
 
-
-static uint16_t memory[UINT16_MAX];
-static uint16_t registers[R_COUNT];
-
-void emulate();
+struct lc3_vm;
+struct lc3_jit;
+struct lc3_profile;
+struct lc3_replay;
+struct lc3_debug;
+struct lc3_device;
 
 uint16_t signExtend(uint16_t x, int bit_count);
 
 uint16_t zeroExtend(uint16_t x, int bit_count);
 
-void updateFlags(uint16_t reg);
+/*
+    Condition codes are evaluated lazily: instructions that set them only copy their result into R_COND,
+    and N, Z and P are derived from it when a BR tests them or someone looks at them.
+*/
+static inline uint16_t conditionFlags(uint16_t result) {
+    return (uint16_t) (1 << (((int16_t) result < 0) * 2 + (result == 0)));
+}
 
-uint16_t memoryRead(uint16_t address);
+// a result that gives the condition codes `flags`, FL_NEG winning over FL_ZR over FL_POS
+static inline uint16_t conditionResult(uint16_t flags) {
+    return (flags & FL_NEG) ? 0x8000 : (flags & FL_ZR) ? 0 : 1;
+}
 
-void memoryWrite(uint16_t address, uint16_t value);
+void updateFlags(struct lc3_vm *vm, uint16_t reg);
 
-uint16_t checkKey();
+uint16_t memoryRead(struct lc3_vm *vm, uint16_t address);
+
+void memoryWrite(struct lc3_vm *vm, uint16_t address, uint16_t value);
 
 uint16_t toLittleEndian16(uint16_t x);
 
-//instruction definition
-void add(uint16_t instruction);
+// handler indices of a predecoded instruction, D_DECODE marks a slot that has to be (re)decoded
+enum {
+    D_DECODE = 0,
+    D_ADD,
+    D_ADD_IMM,
+    D_AND,
+    D_AND_IMM,
+    D_BR,
+    D_JMP,
+    D_JSR,
+    D_JSRR,
+    D_LD,
+    D_LDI,
+    D_LDR,
+    D_LEA,
+    D_NOT,
+    D_ST,
+    D_STI,
+    D_STR,
+    D_TRAP,
+    D_NOP,      // RTI and the reserved opcode
+    D_BR_SPIN,  // BR that closes a loop only polling KBSR, see spinLoop()
+    // superinstructions, an instruction fused with the one right after it, see fuseAt()
+    D_ADD_BR,
+    D_ADD_IMM_BR,
+    D_ADD_IMM_ADD,
+    D_LD_ADD,
+    D_LD_ADD_IMM,
+    D_AND_IMM_ADD_IMM,
+    D_COUNT
+};
+
+/*
+    A superinstruction keeps the fields of its first instruction, the second one is the predecoded slot
+    right after it. Loops that do not run superinstructions as a whole run their first instruction and
+    dispatch the second one on its own.
+*/
+static inline uint8_t firstHandler(uint8_t handler) {
+    switch (handler) {
+        case D_ADD_BR:
+            return D_ADD;
+        case D_ADD_IMM_BR:
+        case D_ADD_IMM_ADD:
+            return D_ADD_IMM;
+        case D_LD_ADD:
+        case D_LD_ADD_IMM:
+            return D_LD;
+        case D_AND_IMM_ADD_IMM:
+            return D_AND_IMM;
+        default:
+            return handler;
+    }
+}
+
+// an instruction word with its fields already extracted
+struct lc3_decoded {
+    uint8_t handler; // D_*
+    uint8_t dr;      // DR, SR of stores, nzp mask of BR
+    uint8_t sr1;     // SR1, BaseR
+    uint8_t sr2;     // SR2
+    uint16_t imm;    // imm5 or PC/base offset already sign-extended, trap vector
+};
+
+// status of runVm()
+enum {
+    VM_HALTED = 0,
+    VM_BUDGET,      // the instruction budget of the slice is used up
+    VM_BLOCKED,     // waiting for input, PC points at the TRAP that asked for it
+    VM_STOPPED,     // hit instructionLimit or timeLimit, see stopReason
+    VM_BREAK,       // about to run the instruction at breakPc or a TRAP matching breakTrap, PC points at it
+};
+
+#define BREAK_ANY_TRAP 0x100 // breakTrap value that matches every trap vector
+
+// why a guest stopped without HALT
+enum {
+    STOP_NONE = 0,
+    STOP_INSTRUCTIONS,
+    STOP_TIMEOUT,
+};
+
+/*
+    Guest memory is split into PAGE_WORDS word pages. A page starts out as part of the image the guest loaded,
+    which is read-only and shared by every guest that loaded the same words, and is copied into the guest on
+    its first write. Pages no image put a word into are one zero page shared by everything, so a guest takes
+    memory for the pages it loaded or wrote and nothing else.
+*/
+#define PAGE_SHIFT 8
+#define PAGE_WORDS (1 << PAGE_SHIFT)
+#define PAGE_COUNT (0x10000 >> PAGE_SHIFT)
+
+// guest memory right after loading, see commitImage()
+struct lc3_image {
+    struct lc3_image *next; // list of the images guests use at the moment, to find one with the same words
+    uint64_t hash;
+    int references;
+    uint16_t *words;             // all 0x10000 words while the image is staged, NULL once it is committed
+    uint16_t *pages[PAGE_COUNT]; // the committed words, the zero page where all of them are 0
+};
+
+#define OUTPUT_BUFFER_SIZE 4096
+#define OUTPUT_FLUSH_INTERVAL_NS 50000000
+
+enum {
+    OUTPUT_BUFFERED = 0, // written when full, before waiting for input, on HALT and at the flush interval
+    OUTPUT_UNBUFFERED,   // written at the end of every trap, for interactive use
+};
+
+// everything one guest owns, several of them can run side by side in one process
+struct lc3_vm {
+    uint16_t registers[R_COUNT];
+    int running;
+    int blocked;
+    uint64_t instructionCount; // retired since startVm()
+    uint64_t instructionLimit; // 0 for none
+    uint64_t timeLimit;        // ns of wall-clock time from startVm(), 0 for none
+    uint64_t deadline;
+    int stopReason;
+    // word `address` is pages[address >> PAGE_SHIFT][address & (PAGE_WORDS - 1)], see memoryPeek()
+    uint16_t *pages[PAGE_COUNT];
+    uint16_t *privatePages[PAGE_COUNT]; // the pages this guest wrote to, NULL while it still shares them
+    struct lc3_image *image;
+    struct lc3_device *devices;                  // newest first, see device.h
+    struct lc3_device *devicePages[PAGE_COUNT]; // first device touching each page, NULL for plain memory
+    // predecode cache, one slot per guest address, filled on first fetch and reset by memoryWrite()
+    struct lc3_decoded decoded[0x10000];
+    struct termios original_tio;
+    struct lc3_jit *jit; // translated code is used when set, see jitInit()
+    struct lc3_profile *profile; // counted by a separate loop when set, see profileAttach()
+    struct lc3_replay *replay;   // input is recorded or replayed when set, see replayAttach()
+    struct lc3_debug *debug;     // breakpoints and watchpoints, see debug.h
+
+    struct lc3_keyboard keyboard;
+    int parkOnInput; // GETC/IN without pending input block the guest instead of the thread
+    uint64_t spinSince; // when the guest got parked in a spin loop, see brSpin()
+
+    // runVm() stops before these, -1 for none. The first instruction after a break always runs.
+    int32_t breakPc;
+    int32_t breakTrap;  // trap vector or BREAK_ANY_TRAP
+    int atBreak;
+
+    // embedder callback, returns 1 if it took care of the trap and 0 to leave it to the VM
+    int (*trapHook)(void *user, struct lc3_vm *vm, uint16_t vector);
+    void *trapData;
+    struct lc3_device *mmio; // the device of yavmSetMmio(), its callbacks get the device's data
+
+    int outputFd;
+    int outputMode;
+    uint64_t flushInterval; // ns, pending output is written at the end of a slice once it is this old
+    uint64_t lastFlush;
+    int outputSize;
+    char outputBuffer[OUTPUT_BUFFER_SIZE];
+};
 
-void ld(uint16_t instruction); // load instruction
-void ldi(uint16_t instruction); // indirect load
-void ldr(uint16_t instruction); //register load
-void st(uint16_t instruction); //store
-void sti(uint16_t instruction); //indirect store
-void str(uint16_t instruction); //register store
-void lea(uint16_t instruction); //load effective address
-void and(uint16_t instruction); //bitwise and
-void not(uint16_t instruction); //bitwise complement
-void br(uint16_t instruction); //branch
-void jmp(uint16_t instruction); //jump
-void jsr(uint16_t instruction); //register jump
-void trap(uint16_t instruction); // trap
+struct lc3_vm *createVm();
 
-static struct termios original_tio;
+// maps every page to the zero page
+void memoryInit(struct lc3_vm *vm);
 
-void disableInputBuffering();
+void memoryDestroy(struct lc3_vm *vm);
 
-void restoreInputBuffering();
+// plain memory at `address`, without the side effects memoryRead() has for device registers
+static inline uint16_t memoryPeek(const struct lc3_vm *vm, uint16_t address) {
+    return vm->pages[address >> PAGE_SHIFT][address & (PAGE_WORDS - 1)];
+}
+
+// 1 if loads and stores at `address` may end up in a device instead of plain memory
+static inline int deviceMapped(const struct lc3_vm *vm, uint16_t address) {
+    return vm->devicePages[address >> PAGE_SHIFT] != NULL;
+}
+
+// gives the guest its own copy of a page it only shared so far, returns it
+uint16_t *copyPage(struct lc3_vm *vm, uint32_t page);
+
+// stores into plain memory like memoryWrite() but leaves devices and the predecode cache alone
+static inline void memoryPoke(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    uint16_t *page = vm->privatePages[address >> PAGE_SHIFT];
+    if (!page) {
+        page = copyPage(vm, address >> PAGE_SHIFT);
+    }
+    page[address & (PAGE_WORDS - 1)] = value;
+}
+
+// drops the predecoded instruction at `address`, and a superinstruction in front of it that covers it too
+static inline void forgetDecoded(struct lc3_vm *vm, uint16_t address) {
+    vm->decoded[address].handler = D_DECODE;
+    struct lc3_decoded *previous = &vm->decoded[(uint16_t) (address - 1)];
+    if (previous->handler > D_BR_SPIN) {
+        previous->handler = D_DECODE;
+    }
+}
+
+// copies all 0x10000 words of guest memory to `words`
+void memorySnapshot(const struct lc3_vm *vm, uint16_t *words);
+
+void destroyVm(struct lc3_vm *vm);
+
+// resets PC to the start of the loaded image
+void startVm(struct lc3_vm *vm);
+
+// runs a started guest for at most `budget` instructions, returns VM_HALTED, VM_BUDGET, VM_BLOCKED, VM_STOPPED
+// or VM_BREAK.
+// Limits are checked between slices, so the time limit is as precise as the budget is small.
+int runVm(struct lc3_vm *vm, uint64_t budget);
+
+// stops a guest that ran out of its limits, for guests that do not run at the moment
+void stopVm(struct lc3_vm *vm, int reason);
+
+uint64_t monotonicNs();
+
+// writes out everything the guest has printed so far
+void flushOutput(struct lc3_vm *vm);
+
+// starts the loaded image and runs it until HALT, returns the number of retired instructions
+uint64_t emulate(struct lc3_vm *vm);
+
+// extracts the fields of an instruction word, only used to generate decodeTable[]
+struct lc3_decoded decodeWord(uint16_t instruction);
+
+// decodeWord() of every instruction word, generated at build time by yavm_decode_gen
+extern const struct lc3_decoded decodeTable[0x10000];
+
+static inline struct lc3_decoded decode(uint16_t instruction) {
+    return decodeTable[instruction];
+}
+
+void invalidateDecoded(struct lc3_vm *vm, uint16_t address, uint32_t count);
+
+// 1 if [target, branch] is a loop that does nothing but wait for KBSR, `resolve` also checks the addresses
+// LDR loads from with the current registers
+int spinLoop(struct lc3_vm *vm, uint16_t target, uint16_t branch, int resolve);
+
+//instruction definition
+void add(struct lc3_vm *vm, const struct lc3_decoded *d);
+void addImm(struct lc3_vm *vm, const struct lc3_decoded *d);
+
+void ld(struct lc3_vm *vm, const struct lc3_decoded *d); // load instruction
+void ldi(struct lc3_vm *vm, const struct lc3_decoded *d); // indirect load
+void ldr(struct lc3_vm *vm, const struct lc3_decoded *d); //register load
+void st(struct lc3_vm *vm, const struct lc3_decoded *d); //store
+void sti(struct lc3_vm *vm, const struct lc3_decoded *d); //indirect store
+void str(struct lc3_vm *vm, const struct lc3_decoded *d); //register store
+void lea(struct lc3_vm *vm, const struct lc3_decoded *d); //load effective address
+void and(struct lc3_vm *vm, const struct lc3_decoded *d); //bitwise and
+void andImm(struct lc3_vm *vm, const struct lc3_decoded *d);
+void not(struct lc3_vm *vm, const struct lc3_decoded *d); //bitwise complement
+void br(struct lc3_vm *vm, const struct lc3_decoded *d); //branch
+void brSpin(struct lc3_vm *vm, const struct lc3_decoded *d);
+void jmp(struct lc3_vm *vm, const struct lc3_decoded *d); //jump
+void jsr(struct lc3_vm *vm, const struct lc3_decoded *d); //register jump
+void jsrr(struct lc3_vm *vm, const struct lc3_decoded *d);
+void trap(struct lc3_vm *vm, const struct lc3_decoded *d); // trap
+
+void disableInputBuffering(struct lc3_vm *vm);
+
+void restoreInputBuffering(struct lc3_vm *vm);
 
 void handleInterrupt();
 
-void setup();
+void setup(struct lc3_vm *vm);
 
 
 //trap procedures
-void trapPuts();
+void trapPuts(struct lc3_vm *vm);
 
-void trapGetc();
+void trapGetc(struct lc3_vm *vm);
 
-void trapOut();
+void trapOut(struct lc3_vm *vm);
 
-void trapIn();
+void trapIn(struct lc3_vm *vm);
 
-void trapPutsp();
+void trapPutsp(struct lc3_vm *vm);
 
-void trapHalt();
+void trapHalt(struct lc3_vm *vm);
 
 //file operations
-void readImageFile(const char *path);
\ No newline at end of file
+void readImageFile(struct lc3_vm *vm, const char *path);
+
+// loads an .obj or .yvm image that is already in memory, `name` only shows up in error messages
+void loadImage(struct lc3_vm *vm, const uint8_t *image, size_t size, const char *name);
+
+// loads a comma separated list of images into one guest
+void readImageFiles(struct lc3_vm *vm, const char *paths);
+
+// a private copy of the guest's memory to load images into
+struct lc3_image *stageImage(struct lc3_vm *vm);
+
+// makes a staged image the guest's memory. It takes over an image another guest already uses if that has the same
+// words, the staged copy is freed then. Pages the guest had written to are dropped.
+void commitImage(struct lc3_vm *vm, struct lc3_image *image);
+
+// drops a reference to an image, freed with the last one
+void releaseImage(struct lc3_image *image);
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include "yavm.h"
+#include "debug.h"
+#include "device.h"
+#include <string.h>
+
+#ifdef YAVM_JIT
+#include "jit.h"
+#endif
+
+// longest run between two output flush and time limit checks
+#define YAVM_SLICE (1u << 20)
+
+struct lc3_vm *yavmCreate(void) {
+    struct lc3_vm *vm = createVm();
+    vm->parkOnInput = 1;
+    startVm(vm);
+    return vm;
+}
+
+void yavmDestroy(struct lc3_vm *vm) {
+    destroyVm(vm);
+}
+
+// translated code of the old image would survive a load
+static void dropTranslations(struct lc3_vm *vm) {
+#ifdef YAVM_JIT
+    if (vm->jit) {
+        jitDestroy(vm);
+        jitInit(vm);
+    }
+#else
+    (void) vm;
+#endif
+}
+
+void yavmLoadImage(struct lc3_vm *vm, const char *paths) {
+    readImageFiles(vm, paths);
+    dropTranslations(vm);
+}
+
+void yavmLoadImageBuffer(struct lc3_vm *vm, const void *image, size_t size) {
+    loadImage(vm, image, size, "buffer");
+    dropTranslations(vm);
+}
+
+void yavmReset(struct lc3_vm *vm) {
+    memset(vm->registers, 0, sizeof(vm->registers));
+    vm->blocked = 0;
+    vm->atBreak = 0;
+    startVm(vm);
+}
+
+int yavmStep(struct lc3_vm *vm, uint64_t count) {
+    return runVm(vm, count);
+}
+
+int yavmRunUntil(struct lc3_vm *vm, const struct yavm_until *until) {
+    vm->breakPc = until->pc;
+    vm->breakTrap = until->trap;
+    int status;
+    for (;;) {
+        uint64_t budget = YAVM_SLICE;
+        if (until->instructions) {
+            if (vm->instructionCount >= until->instructions) {
+                status = VM_BUDGET;
+                break;
+            }
+            uint64_t left = until->instructions - vm->instructionCount;
+            budget = left < budget ? left : budget;
+        }
+        status = runVm(vm, budget);
+        if (status != VM_BUDGET) {
+            break;
+        }
+    }
+    vm->breakPc = -1;
+    vm->breakTrap = -1;
+    return status;
+}
+
+void yavmHalt(struct lc3_vm *vm) {
+    flushOutput(vm);
+    vm->running = 0;
+}
+
+void yavmSetBreakpoint(struct lc3_vm *vm, uint16_t address, int enabled) {
+    debugSetBreakpoint(vm, address, enabled);
+}
+
+int yavmWatch(struct lc3_vm *vm, uint16_t start, uint16_t end, int enabled) {
+    return debugWatch(vm, start, end, enabled);
+}
+
+int yavmWatchHit(struct lc3_vm *vm, uint16_t *address, uint16_t *oldValue, uint16_t *newValue) {
+    if (!vm->debug || !vm->debug->watchHit) {
+        return 0;
+    }
+    *address = vm->debug->hitAddress;
+    *oldValue = vm->debug->oldValue;
+    *newValue = vm->debug->newValue;
+    return 1;
+}
+
+uint16_t yavmGetRegister(struct lc3_vm *vm, int reg) {
+    return reg == R_COND ? conditionFlags(vm->registers[R_COND]) : vm->registers[reg];
+}
+
+void yavmSetRegister(struct lc3_vm *vm, int reg, uint16_t value) {
+    vm->registers[reg] = reg == R_COND ? conditionResult(value) : value;
+    if (reg == R_PC) {
+        // a new PC is not the instruction the last run stopped before
+        vm->atBreak = 0;
+    }
+}
+
+uint16_t yavmReadMemory(struct lc3_vm *vm, uint16_t address) {
+    return memoryPeek(vm, address);
+}
+
+void yavmWriteMemory(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    memoryPoke(vm, address, value);
+    forgetDecoded(vm, address);
+#ifdef YAVM_JIT
+    if (vm->jit && vm->jit->codeMap[address]) {
+        jitInvalidate(vm, address);
+    }
+#endif
+}
+
+uint64_t yavmInstructionCount(struct lc3_vm *vm) {
+    return vm->instructionCount;
+}
+
+void yavmSetIo(struct lc3_vm *vm, int inputFd, int outputFd) {
+    flushOutput(vm);
+    if (inputFd != vm->keyboard.fd) {
+        // neither bytes buffered from the old input nor its end carry over to the new one
+        int threaded = vm->keyboard.threaded;
+        keyboardStop(&vm->keyboard);
+        keyboardInit(&vm->keyboard, inputFd);
+        if (threaded) {
+            keyboardStartThread(&vm->keyboard);
+        }
+    }
+    vm->outputFd = outputFd;
+}
+
+void yavmSetTrapHandler(struct lc3_vm *vm, yavm_trap_fn handler, void *user) {
+    vm->trapHook = handler;
+    vm->trapData = user;
+}
+
+void yavmSetMmio(struct lc3_vm *vm, yavm_mmio_read_fn read, yavm_mmio_write_fn write, void *user) {
+    if (vm->mmio) {
+        deviceRemove(vm, vm->mmio);
+        vm->mmio = NULL;
+    }
+    if (read || write) {
+        vm->mmio = deviceAdd(vm, MR_KBSR, UINT16_MAX, read, write, user);
+    }
+}
+
+struct lc3_device *yavmAddDevice(struct lc3_vm *vm, uint16_t start, uint16_t end, yavm_mmio_read_fn read,
+                                 yavm_mmio_write_fn write, void *user) {
+    return deviceAdd(vm, start, end, read, write, user);
+}
+
+void yavmRemoveDevice(struct lc3_vm *vm, struct lc3_device *device) {
+    if (device == vm->mmio) {
+        vm->mmio = NULL;
+    }
+    deviceRemove(vm, device);
+}
+
+int yavmEnableJit(struct lc3_vm *vm) {
+#ifdef YAVM_JIT
+    jitInit(vm);
+    return 1;
+#else
+    (void) vm;
+    return 0;
+#endif
+}
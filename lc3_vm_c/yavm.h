@@ -0,0 +1,94 @@
+#pragma once
+
+#include "vm.h"
+
+/*
+    libyavm, the VM as a library for embedding guests into another program's event loop.
+
+    A guest starts out empty with its PC at 0x3000, reading input from stdin and writing output to stdout
+    until yavmSetIo() points it elsewhere. GETC, IN and spin loops on KBSR without pending input make
+    yavmStep() and yavmRunUntil() return VM_BLOCKED instead of waiting, so one thread can drive any number of
+    guests: run the ones that can make progress and poll the input fds of the blocked ones.
+
+    Traps and the device page can be taken over with callbacks, and further devices can be added at any
+    address range. A callback returning 0 leaves the trap or access to the built-in implementation. A trap
+    callback may call yavmHalt().
+
+    Malformed images end the process like they do in vm_c. Batches of guests running the same image with
+    different input are better off in lockstep.h, which the library includes as well.
+*/
+
+// stop conditions of yavmRunUntil(), checked before every instruction
+struct yavm_until {
+    int32_t pc;            // stop before the instruction at this address, -1 for none
+    int32_t trap;          // stop before a TRAP with this vector or BREAK_ANY_TRAP, -1 for none
+    uint64_t instructions; // stop once yavmInstructionCount() reaches this, 0 for none
+};
+
+typedef int (*yavm_trap_fn)(void *user, struct lc3_vm *vm, uint16_t vector);
+typedef int (*yavm_mmio_read_fn)(void *user, uint16_t address, uint16_t *value);
+typedef int (*yavm_mmio_write_fn)(void *user, uint16_t address, uint16_t value);
+
+struct lc3_vm *yavmCreate(void);
+
+void yavmDestroy(struct lc3_vm *vm);
+
+// a comma separated list of .obj or .yvm files
+void yavmLoadImage(struct lc3_vm *vm, const char *paths);
+
+void yavmLoadImageBuffer(struct lc3_vm *vm, const void *image, size_t size);
+
+// clears the registers and the instruction count and puts PC back at 0x3000, memory stays as it is
+void yavmReset(struct lc3_vm *vm);
+
+// runs up to `count` instructions, returns VM_HALTED, VM_BUDGET, VM_BLOCKED, VM_STOPPED or VM_BREAK for a
+// breakpoint or watchpoint
+int yavmStep(struct lc3_vm *vm, uint64_t count);
+
+// runs until one of the `until` conditions holds (VM_BREAK, or VM_BUDGET for the instruction count), HALT,
+// blocking on input or a limit. The instruction a run stopped before always runs when the guest continues.
+int yavmRunUntil(struct lc3_vm *vm, const struct yavm_until *until);
+
+// stops the guest, VM_HALTED from then on until yavmReset()
+void yavmHalt(struct lc3_vm *vm);
+
+// VM_BREAK before the instruction at `address`, see debug.h
+void yavmSetBreakpoint(struct lc3_vm *vm, uint16_t address, int enabled);
+
+// VM_BREAK right after a store into [start, end], returns 0 when end < start, no watchpoint is left or, when
+// removing, there is none with exactly that range
+int yavmWatch(struct lc3_vm *vm, uint16_t start, uint16_t end, int enabled);
+
+// the store behind the last VM_BREAK, returns 0 if that was no watchpoint
+int yavmWatchHit(struct lc3_vm *vm, uint16_t *address, uint16_t *oldValue, uint16_t *newValue);
+
+// R_COND reads as FL_NEG, FL_ZR or FL_POS and takes one of them
+uint16_t yavmGetRegister(struct lc3_vm *vm, int reg);
+
+void yavmSetRegister(struct lc3_vm *vm, int reg, uint16_t value);
+
+// plain memory access without device side effects
+uint16_t yavmReadMemory(struct lc3_vm *vm, uint16_t address);
+
+void yavmWriteMemory(struct lc3_vm *vm, uint16_t address, uint16_t value);
+
+uint64_t yavmInstructionCount(struct lc3_vm *vm);
+
+// input is read from and output written to these from now on, the caller keeps owning them
+void yavmSetIo(struct lc3_vm *vm, int inputFd, int outputFd);
+
+void yavmSetTrapHandler(struct lc3_vm *vm, yavm_trap_fn handler, void *user);
+
+// callbacks for MR_KBSR and up, ahead of the console and of devices added before
+void yavmSetMmio(struct lc3_vm *vm, yavm_mmio_read_fn read, yavm_mmio_write_fn write, void *user);
+
+// a device claiming [start, end] ahead of the ones already there, see device.h. Either callback may be NULL.
+// Set devices up before running the guest, adding or removing one drops its JIT translations.
+struct lc3_device *yavmAddDevice(struct lc3_vm *vm, uint16_t start, uint16_t end, yavm_mmio_read_fn read,
+                                 yavm_mmio_write_fn write, void *user);
+
+void yavmRemoveDevice(struct lc3_vm *vm, struct lc3_device *device);
+
+// translates guest code to x86-64 from now on, returns 0 if the library was built without the JIT. Runs
+// that stop at a PC or a trap are still interpreted.
+int yavmEnableJit(struct lc3_vm *vm);